@@ -22,6 +22,32 @@ auto MultiArray<Tp, rank>::CalcStrides(const Index &dims) -> Index {
 	return strides;
 }
 
+template<typename Tp, size_t rank>
+auto MultiArray<Tp, rank>::Cast(const std::shared_ptr<void> &buffer) -> PtrTp {
+	static_assert(std::is_trivially_copyable<Tp>::value && std::is_trivially_destructible<Tp>::value,
+	              "MultiArray buffers are raw memory, so can only hold plain types.");
+	return std::static_pointer_cast<Tp>(buffer);
+}
+
+template<typename Tp, size_t rank>
+auto MultiArray<Tp, rank>::Allocate(const size_t n, const BufferOptions &opts) -> PtrTp {
+	PtrTp ptr = Cast(BufferPool::Allocate(n * sizeof(Tp), opts));
+	if (opts.zero) {
+		std::fill_n(ptr.get(), n, Tp());
+	}
+	return ptr;
+}
+
+template<typename Tp, size_t rank>
+auto MultiArray<Tp, rank>::MapFile(const Index &dims, const std::string &path, const size_t offset) -> MultiArray {
+	return MultiArray(dims, Cast(MappedBuffer::Map(path, offset, dims.prod() * sizeof(Tp))));
+}
+
+template<typename Tp, size_t rank>
+auto MultiArray<Tp, rank>::MapScratch(const Index &dims, const std::string &dir) -> MultiArray {
+	return MultiArray(dims, Cast(MappedBuffer::Scratch(dir, dims.prod() * sizeof(Tp))));
+}
+
 template<typename Tp, size_t rank>
 MultiArray<Tp, rank>::MultiArray() :
 	m_offset{0},
@@ -33,25 +59,25 @@ MultiArray<Tp, rank>::MultiArray() :
 }
 
 template<typename Tp, size_t rank>
-MultiArray<Tp, rank>::MultiArray(const Index &inDims) :
+MultiArray<Tp, rank>::MultiArray(const Index &inDims, const BufferOptions &opts) :
 	m_offset{0},
 	m_dims{inDims},
 	m_strides{CalcStrides(inDims)},
-	m_ptr{std::make_shared<std::vector<Tp>>(inDims.prod())},
+	m_ptr{Allocate(inDims.prod(), opts)},
 	m_packed{true}
 {
 
 }
 
 template<typename Tp, size_t rank>
-MultiArray<Tp, rank>::MultiArray(const Eigen::Array<size_t, rank - 1, 1> &inDims, const size_t finalDim) :
+MultiArray<Tp, rank>::MultiArray(const Eigen::Array<size_t, rank - 1, 1> &inDims, const size_t finalDim, const BufferOptions &opts) :
 	m_offset{0},
 	m_packed{true}
 {
 	m_dims.head(rank - 1) = inDims;
 	m_dims[rank - 1] = finalDim;
 	m_strides = CalcStrides(m_dims);
-	m_ptr = std::make_shared<std::vector<Tp>>(m_dims.prod());
+	m_ptr = Allocate(m_dims.prod(), opts);
 }
 
 template<typename Tp, size_t rank>
@@ -85,7 +111,7 @@ typename MultiArray<Tp, rank>::const_reference MultiArray<Tp, rank>::operator[](
 		ss << "Voxel " << vox.transpose() << " outside volume.\n" << print();
 		throw(std::out_of_range(ss.str()));
 	}
-	return (*m_ptr)[m_offset + (vox * m_strides).sum()];
+	return m_ptr.get()[m_offset + (vox * m_strides).sum()];
 }
 
 template<typename Tp, size_t rank>
@@ -98,7 +124,7 @@ typename MultiArray<Tp, rank>::const_reference MultiArray<Tp, rank>::operator[](
 	if (i >= size()) {
 		throw(std::out_of_range("Index " + std::to_string(i) + " out of range.\n" + print()));
 	}
-	return (*m_ptr)[m_offset + i];
+	return m_ptr.get()[m_offset + i];
 }
 
 template<typename Tp, size_t rank>
@@ -106,17 +132,40 @@ typename MultiArray<Tp, rank>::reference MultiArray<Tp, rank>::operator[](const
 	return const_cast<reference>(static_cast<const MultiArray<Tp, rank> &>(*this).operator[](i));
 }
 
+template<typename Tp, size_t rank>
+template<typename... Ix>
+size_t MultiArray<Tp, rank>::dataIndex(const Ix... ix) const {
+	static_assert(sizeof...(Ix) == rank, "MultiArray needs one index per dimension.");
+	const size_t vox[rank]{static_cast<size_t>(ix)...};
+	size_t index = m_offset;
+	for (size_t d = 0; d < rank; d++) { // rank is known, so this unrolls
+		assert(vox[d] < m_dims[d]);
+		index += vox[d] * m_strides[d];
+	}
+	return index;
+}
+
+template<typename Tp, size_t rank>
+template<typename... Ix>
+auto MultiArray<Tp, rank>::operator()(const Ix... ix) const -> const_reference {
+	return m_ptr.get()[dataIndex(ix...)];
+}
+
+template<typename Tp, size_t rank>
+template<typename... Ix>
+auto MultiArray<Tp, rank>::operator()(const Ix... ix) -> reference {
+	return m_ptr.get()[dataIndex(ix...)];
+}
+
 template<typename Tp, size_t rank>
 MultiArray<Tp, rank> MultiArray<Tp, rank>::pack() const {
 	if (isPacked()) {
 		return MultiArray<Tp, rank>(*this);
 	} else {
 		MultiArray<Tp, rank> p(m_dims);
-		iterator this_it = begin();
-		iterator that_it = p.begin();
-		while (this_it != end()) {
-			*that_it++ = *this_it++;
-		}
+		MultiArray<Tp, rank> src(*this); // Shares the data, but iterators need a non-const array
+		std::copy(src.begin(), src.end(), p.packedBegin());
+		return p;
 	}
 }
 
@@ -183,7 +232,7 @@ MultiArray<Tp, newRank> MultiArray<Tp, rank>::slice(const Index &start, const In
 // Can't partially specialize this, just not allowed :-(
 template<typename Tp, size_t rank>
 auto MultiArray<Tp, rank>::asArray() const -> MapTp {
-	auto ptr = m_ptr->data() + m_offset;
+	auto ptr = m_ptr.get() + m_offset;
 	if (rank == 1) {
 		// Outer and inner strides are reversed in Eigen constructor
 		const Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic> strides(0, m_strides[0]);
@@ -198,11 +247,37 @@ auto MultiArray<Tp, rank>::asArray() const -> MapTp {
 	}
 }
 
+template<typename Tp, size_t rank> auto MultiArray<Tp, rank>::data() -> pointer { return m_ptr.get() + m_offset; }
+template<typename Tp, size_t rank> auto MultiArray<Tp, rank>::data() const -> const_pointer { return m_ptr.get() + m_offset; }
+
+template<typename Tp, size_t rank>
+auto MultiArray<Tp, rank>::packedBegin() -> pointer {
+	return const_cast<pointer>(static_cast<const MultiArray<Tp, rank> &>(*this).packedBegin());
+}
+
+template<typename Tp, size_t rank>
+auto MultiArray<Tp, rank>::packedEnd() -> pointer {
+	return packedBegin() + size();
+}
+
+template<typename Tp, size_t rank>
+auto MultiArray<Tp, rank>::packedBegin() const -> const_pointer {
+	if (!isPacked()) {
+		throw(std::runtime_error("MultiArrays must be packed for pointer iteration."));
+	}
+	return data();
+}
+
+template<typename Tp, size_t rank>
+auto MultiArray<Tp, rank>::packedEnd() const -> const_pointer {
+	return packedBegin() + size();
+}
+
 template<typename Tp, size_t rank>
 std::string MultiArray<Tp, rank>::print() const {
 	std::stringstream ss;
 	if (m_ptr) {
-		ss << "MultiArray " << m_ptr->data() << " Offset: " << m_offset << " Share count: " << m_ptr.use_count() << std::endl;
+		ss << "MultiArray " << m_ptr.get() << " Offset: " << m_offset << " Share count: " << m_ptr.use_count() << std::endl;
 		ss << "Dims:    " << m_dims.transpose() << std::endl;
 		ss << "Strides: " << m_strides.transpose() << std::endl;
 	} else {
@@ -218,41 +293,40 @@ std::string MultiArray<Tp, rank>::print() const {
  *****************************************************************************/
 template<typename Tp, size_t rank>
 MultiArray<Tp, rank>::MultiArrayIterator::MultiArrayIterator(MultiArray &array, Index start) :
-	m_array(array),
+	m_data(array.m_ptr.get()),
+	m_dims(array.m_dims),
+	m_strides(array.m_strides),
 	m_voxelIndex(start),
 	m_dataIndex(array.m_offset + (array.m_strides * start).sum()),
-	m_endflag(false)
+	m_remaining(0)
 {
-	if ((start == m_array.m_dims).all()) {
-		m_endflag = true;
+	if (!(start == m_dims).all()) {
+		m_remaining = array.size() - (start * CalcStrides(m_dims)).sum();
 	}
 }
 
 template<typename Tp, size_t rank>
 Tp &MultiArray<Tp, rank>::iterator::operator*() {
-	return (*m_array.m_ptr)[m_dataIndex];
+	return m_data[m_dataIndex];
 }
 
 template<typename Tp, size_t rank>
 auto MultiArray<Tp, rank>::iterator::operator++() -> iterator & {
-	size_t dim;
-	for (dim = 0; dim < rank; dim++) {
+	m_remaining--;
+	for (size_t dim = 0; dim < rank; dim++) {
 		m_voxelIndex[dim]++;
-		m_dataIndex += m_array.m_strides[dim];
-		if (m_voxelIndex[dim] == m_array.dims()[dim]) {
+		m_dataIndex += m_strides[dim];
+		if (m_voxelIndex[dim] == m_dims[dim]) {
 			// We hit the end of this dimension, subtract off the accumulated increment
 			// and reset so we point to the first element of the subsequent 'column'
 			// when the next dimension is incremented.
-			m_dataIndex -= m_array.m_strides[dim] * m_voxelIndex[dim];
+			m_dataIndex -= m_strides[dim] * m_voxelIndex[dim];
 			m_voxelIndex[dim] = 0;
 		} else {
 			// This dimension still has increments left
 			break;
 		}
 	}
-	if (dim == rank) {
-		m_endflag = true;
-	}
 	return *this;
 }
 
@@ -265,14 +339,7 @@ auto MultiArray<Tp, rank>::iterator::operator++(int) -> iterator {
 
 template<typename Tp, size_t rank>
 bool MultiArray<Tp, rank>::iterator::operator==(const iterator &other) const {
-	if (m_array.m_ptr == other.m_array.m_ptr) {
-		if (m_dataIndex == other.m_dataIndex) {
-			return true;
-		} else if (m_endflag && other.m_endflag) {
-			return true;
-		}
-	}
-	return false;
+	return (m_remaining == other.m_remaining) && (m_data == other.m_data);
 }
 
 template<typename Tp, size_t rank>
@@ -16,28 +16,42 @@
 #include <iostream>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <memory>
 #include <exception>
 #include <stdexcept>
+#include <cassert>
+#include <type_traits>
 
 #include "Eigen/Core"
 #include "Eigen/Geometry"
 
+#include "MultiArrayStorage.h"
+
+template<typename Derived> class ArrayExpr;
+
 template<typename Tp, size_t rank>
 class MultiArray {
 	public:
 		typedef Eigen::Array<size_t, rank, 1> Index;
 		typedef Eigen::Array<size_t, rank - 1, 1> SmallIndex;
-		typedef std::vector<Tp> StorageTp;
-		typedef std::shared_ptr<StorageTp> PtrTp;
+		typedef std::shared_ptr<Tp> PtrTp; //!< The whole buffer, which slices share
 		typedef Eigen::Map<Eigen::Array<Tp, Eigen::Dynamic, Eigen::Dynamic>, Eigen::Unaligned, Eigen::Stride<Eigen::Dynamic, Eigen::Dynamic>> MapTp;
 		// These typedefs are for STL Iterator compatibility
 		typedef Tp        value_type;
 		typedef size_t    size_type;
 		typedef ptrdiff_t difference_type;
-		typedef typename StorageTp::const_reference const_reference;
-		typedef typename StorageTp::reference       reference;
-		
+		typedef const Tp &const_reference;
+		typedef Tp       &reference;
+		typedef Tp       *pointer;
+		typedef const Tp *const_pointer;
+
+		/*
+		 *  Walks the array in storage order for any strides, carrying into the
+		 *  next dimension at the end of each one. Packed arrays are a single run
+		 *  of memory, so prefer data() or packedBegin() for those, which give
+		 *  plain pointers that the STL algorithms and the compiler can vectorise.
+		 */
 		class MultiArrayIterator {
 			public:
 				typedef std::forward_iterator_tag iterator_category;
@@ -50,10 +64,10 @@ class MultiArray {
 				typedef const Tp  &const_reference;
 
 			private:
-				MultiArray &m_array;
-				Index m_voxelIndex;
+				Tp    *m_data;      //!< Start of the storage, not of the array
+				Index  m_dims, m_strides, m_voxelIndex;
 				size_t m_dataIndex;
-				bool m_endflag;
+				size_t m_remaining; //!< Elements left to visit, 0 at the end
 
 			public:
 				MultiArrayIterator(MultiArray &array, Index start = Index::Zero());
@@ -75,11 +89,17 @@ class MultiArray {
 		bool   m_packed;
 		
 		static Index CalcStrides(const Index &dims);
+		static PtrTp Allocate(const size_t n, const BufferOptions &opts);
+		static PtrTp Cast(const std::shared_ptr<void> &buffer);
+		template<typename... Ix> size_t dataIndex(const Ix... ix) const;
 	public:
 		MultiArray();
-		MultiArray(const Index &dims);
-        MultiArray(const Index &dims, PtrTp ptr, const Index &strides = Index::Zero(), const size_t offset = 0);
-		MultiArray(const SmallIndex &dims, const size_t finalDim);
+		MultiArray(const Index &dims, const BufferOptions &opts = BufferOptions());
+		MultiArray(const Index &dims, PtrTp ptr, const Index &strides = Index::Zero(), const size_t offset = 0);
+		MultiArray(const SmallIndex &dims, const size_t finalDim, const BufferOptions &opts = BufferOptions());
+		template<typename Derived> MultiArray(const ArrayExpr<Derived> &e);                            //!< A new packed array holding the result of e
+		static MultiArray MapFile(const Index &dims, const std::string &path, const size_t offset = 0); //!< Onto the bytes of path from offset, keeping what is there
+		static MultiArray MapScratch(const Index &dims, const std::string &dir);                         //!< Onto a temporary file in dir, starts as zeros
 
 		const Index &dims() const;
 		const Index &strides() const;
@@ -91,11 +111,25 @@ class MultiArray {
 		template<size_t newRank> MultiArray<Tp, newRank> slice(const Index &start, const Index &size, const Index &strides = Index::Ones()) const;
 		MapTp asArray() const;
 
+		// Raw access. data() is the first element, and only runs contiguously
+		// for size() elements if the array is packed.
+		pointer data();
+		const_pointer data() const;
+		pointer packedBegin();             //!< Throws if the array is not packed
+		pointer packedEnd();
+		const_pointer packedBegin() const;
+		const_pointer packedEnd() const;
+
 		// STL-like interface
 		const_reference operator[](const size_t i) const;
 		const_reference operator[](const Index &vox) const;
 		reference operator[](const size_t i);
 		reference operator[](const Index &vox);
+		template<typename Derived> MultiArray &operator=(const ArrayExpr<Derived> &e); //!< Writes into these elements, unlike copying another MultiArray, which shares its data
+
+		// One index per dimension, not checked unless NDEBUG is undefined. For inner loops.
+		template<typename... Ix> const_reference operator()(const Ix... ix) const;
+		template<typename... Ix> reference operator()(const Ix... ix);
 		
 		iterator begin();
 		iterator end();
@@ -109,5 +143,6 @@ class MultiArray {
 
 // Template definitions
 #include "MultiArray-inl.h"
+#include "MultiArrayExpr.h"
 
 #endif //MULTIARRAY_H
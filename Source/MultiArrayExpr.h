@@ -0,0 +1,370 @@
+/*
+ *  MultiArrayExpr.h
+ *  Part of the QUantitative Image Toolbox
+ *
+ *  Copyright (c) 2014 Tobias Wood. All rights reserved.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_MULTIARRAYEXPR_H
+#define QUIT_MULTIARRAYEXPR_H
+
+#include <complex>
+#include <cmath>
+#include <type_traits>
+
+/*
+ *  Lazy element-wise expressions on MultiArrays, so that something like
+ *
+ *      a = a * filter * Broadcast<1>(ramp);
+ *
+ *  is a single pass over a instead of one per operation. Operands can be
+ *  MultiArrays of the same dims, scalars, or a vector broadcast along one
+ *  dimension. Nothing is computed until the expression is assigned to a
+ *  MultiArray, which writes into that array's existing elements, or used to
+ *  construct one, which makes a new packed array.
+ *
+ *  Expressions hold pointers to the arrays they read, so must not outlive
+ *  them. Assigning to an array that is also read is fine, since each element
+ *  is read before it is written, unless the array is read broadcast.
+ *
+ *  Evaluation goes a row of the first dimension at a time, so each node only
+ *  has to supply a Row, an object that returns element x of the row that
+ *  starts at a given index. The inner loop over x is then simple enough for
+ *  the compiler to vectorise. Parts of an expression that are constant along
+ *  a row, like scalars or vectors broadcast along another dimension, are
+ *  worked out once per row, so bracket them together: a * (ramp_y * ramp_z)
+ *  does one multiply per element where a * ramp_y * ramp_z does two.
+ */
+
+template<typename Derived>
+class ArrayExpr {
+	public:
+		const Derived &derived() const { return static_cast<const Derived &>(*this); }
+};
+
+namespace ExprDetail {
+
+template<typename T> struct IsComplex : std::false_type {};
+template<typename T> struct IsComplex<std::complex<T>> : std::true_type {};
+template<typename T> struct IsScalar : std::integral_constant<bool, std::is_arithmetic<T>::value || IsComplex<T>::value> {};
+
+/*
+ *  Every node has a value_type, a Rank that is 0 if it fits any rank, check()
+ *  to throw if it cannot be evaluated over dims, and row(start). Nodes with a
+ *  Rank also have dims().
+ */
+template<typename Tp, size_t rank>
+class ArrayLeaf : public ArrayExpr<ArrayLeaf<Tp, rank>> {
+	public:
+		typedef Tp value_type;
+		typedef typename MultiArray<Tp, rank>::Index Index;
+		static const size_t Rank = rank;
+
+		struct Row {
+			const Tp *p;
+			size_t stride;
+			const Tp &operator[](const size_t x) const { return p[x * stride]; }
+		};
+
+	protected:
+		const Tp *m_data;
+		Index m_dims, m_strides;
+
+	public:
+		ArrayLeaf(const MultiArray<Tp, rank> &a) : m_data(a.data()), m_dims(a.dims()), m_strides(a.strides()) {}
+
+		const Index &dims() const { return m_dims; }
+		void check(const Index &dims) const {
+			if ((dims != m_dims).any())
+				throw(std::logic_error("MultiArray dimensions do not match in expression."));
+		}
+		Row row(const Index &start) const { return Row{m_data + (start * m_strides).sum(), m_strides[0]}; }
+};
+
+// A row that is the same value all along, which operations on work out once per row
+template<typename Tp>
+struct ConstantRow {
+	Tp v;
+	Tp operator[](const size_t) const { return v; }
+};
+template<typename Row> struct IsConstantRow : std::false_type {};
+template<typename Tp> struct IsConstantRow<ConstantRow<Tp>> : std::true_type {};
+
+template<typename Tp>
+class ScalarLeaf : public ArrayExpr<ScalarLeaf<Tp>> {
+	public:
+		typedef Tp value_type;
+		typedef ConstantRow<Tp> Row;
+		static const size_t Rank = 0;
+
+	protected:
+		Tp m_value;
+
+	public:
+		ScalarLeaf(const Tp &v) : m_value(v) {}
+
+		template<typename I> void check(const I &) const {}
+		template<typename I> Row row(const I &) const { return Row{m_value}; }
+};
+
+/*
+ *  A vector that varies along dimension dim and is constant along the
+ *  others. Along the first dimension each row reads the vector, otherwise a
+ *  row is one value.
+ */
+template<typename Tp, size_t dim>
+class BroadcastLeaf : public ArrayExpr<BroadcastLeaf<Tp, dim>> {
+	public:
+		typedef Tp value_type;
+		typedef Eigen::Array<Tp, Eigen::Dynamic, 1> VectorTp;
+		static const size_t Rank = 0;
+
+		struct VectorRow {
+			const Tp *p;
+			const Tp &operator[](const size_t x) const { return p[x]; }
+		};
+		typedef typename std::conditional<dim == 0, VectorRow, ConstantRow<Tp>>::type Row;
+
+	protected:
+		VectorTp m_vector;
+
+		template<typename I> VectorRow rowOf(const I &, std::true_type) const { return VectorRow{m_vector.data()}; }
+		template<typename I> ConstantRow<Tp> rowOf(const I &start, std::false_type) const {
+			return ConstantRow<Tp>{m_vector[start[dim]]};
+		}
+
+	public:
+		BroadcastLeaf(const VectorTp &v) : m_vector(v) {}
+
+		template<typename I> void check(const I &dims) const {
+			static_assert(dim < I::RowsAtCompileTime, "Broadcast dimension is past the rank of the expression.");
+			if (static_cast<size_t>(m_vector.rows()) != dims[dim])
+				throw(std::logic_error("Broadcast vector length does not match MultiArray dimension " + std::to_string(dim) + "."));
+		}
+		template<typename I> Row row(const I &start) const { return rowOf(start, std::integral_constant<bool, dim == 0>()); }
+};
+
+// What an operand becomes in an expression
+template<typename T, typename Enable = void> struct Lift {};
+template<typename T> struct Lift<T, typename std::enable_if<IsScalar<T>::value>::type> {
+	typedef ScalarLeaf<T> type;
+	static type Make(const T &v) { return type(v); }
+};
+template<typename Tp, size_t rank> struct Lift<MultiArray<Tp, rank>> {
+	typedef ArrayLeaf<Tp, rank> type;
+	static type Make(const MultiArray<Tp, rank> &a) { return type(a); }
+};
+template<typename T> struct Lift<T, typename std::enable_if<std::is_base_of<ArrayExpr<T>, T>::value>::type> {
+	typedef T type;
+	static const T &Make(const T &e) { return e; }
+};
+
+template<typename T> struct IsOperand : std::false_type {};
+template<typename Tp, size_t rank> struct IsOperand<MultiArray<Tp, rank>> : std::true_type {};
+template<typename T> struct IsExpr : std::integral_constant<bool, IsOperand<T>::value || std::is_base_of<ArrayExpr<T>, T>::value> {};
+
+// Only take over an operator if one side is an array or expression and the other could be
+template<typename A, typename B> struct EnableBinary : std::enable_if<
+	(IsExpr<A>::value && (IsExpr<B>::value || IsScalar<B>::value)) ||
+	(IsScalar<A>::value && IsExpr<B>::value)> {};
+
+template<typename A, typename B>
+class BinaryBase {
+	public:
+		static const size_t Rank = A::Rank ? A::Rank : B::Rank;
+		static_assert(!A::Rank || !B::Rank || (A::Rank == B::Rank), "MultiArray ranks do not match in expression.");
+		typedef Eigen::Array<size_t, Rank, 1> Index;
+
+	protected:
+		A m_a;
+		B m_b;
+
+		Index dimsOf(std::true_type) const { return m_a.dims(); }
+		Index dimsOf(std::false_type) const { return m_b.dims(); }
+
+	public:
+		BinaryBase(const A &a, const B &b) : m_a(a), m_b(b) {}
+
+		Index dims() const { return dimsOf(std::integral_constant<bool, (A::Rank > 0)>()); }
+		template<typename I> void check(const I &dims) const { m_a.check(dims); m_b.check(dims); }
+};
+
+template<typename Op, typename A, typename B>
+class BinaryExpr : public ArrayExpr<BinaryExpr<Op, A, B>>, public BinaryBase<A, B> {
+	public:
+		typedef decltype(Op()(std::declval<typename A::value_type>(), std::declval<typename B::value_type>())) value_type;
+
+		struct ElementRow {
+			typename A::Row a;
+			typename B::Row b;
+			value_type operator[](const size_t x) const { return Op()(a[x], b[x]); }
+		};
+		typedef std::integral_constant<bool, IsConstantRow<typename A::Row>::value && IsConstantRow<typename B::Row>::value> Constant;
+		typedef typename std::conditional<Constant::value, ConstantRow<value_type>, ElementRow>::type Row;
+
+	protected:
+		template<typename I> ElementRow rowOf(const I &start, std::false_type) const { return ElementRow{this->m_a.row(start), this->m_b.row(start)}; }
+		template<typename I> ConstantRow<value_type> rowOf(const I &start, std::true_type) const {
+			return ConstantRow<value_type>{Op()(this->m_a.row(start).v, this->m_b.row(start).v)};
+		}
+
+	public:
+		BinaryExpr(const A &a, const B &b) : BinaryBase<A, B>(a, b) {}
+		template<typename I> Row row(const I &start) const { return rowOf(start, Constant()); }
+};
+
+template<typename Op, typename A>
+class UnaryExpr : public ArrayExpr<UnaryExpr<Op, A>> {
+	public:
+		typedef decltype(Op()(std::declval<typename A::value_type>())) value_type;
+		static const size_t Rank = A::Rank;
+		typedef Eigen::Array<size_t, Rank, 1> Index;
+
+		struct ElementRow {
+			typename A::Row a;
+			value_type operator[](const size_t x) const { return Op()(a[x]); }
+		};
+		typedef IsConstantRow<typename A::Row> Constant;
+		typedef typename std::conditional<Constant::value, ConstantRow<value_type>, ElementRow>::type Row;
+
+	protected:
+		A m_a;
+
+		template<typename I> ElementRow rowOf(const I &start, std::false_type) const { return ElementRow{m_a.row(start)}; }
+		template<typename I> ConstantRow<value_type> rowOf(const I &start, std::true_type) const { return ConstantRow<value_type>{Op()(m_a.row(start).v)}; }
+
+	public:
+		UnaryExpr(const A &a) : m_a(a) {}
+
+		Index dims() const { return m_a.dims(); }
+		template<typename I> void check(const I &dims) const { m_a.check(dims); }
+		template<typename I> Row row(const I &start) const { return rowOf(start, Constant()); }
+};
+
+#define QUIT_EXPR_BINARY_OP(Name, op) \
+struct Name { \
+	template<typename X, typename Y> auto operator()(const X &x, const Y &y) const -> decltype(x op y) { return x op y; } \
+};
+QUIT_EXPR_BINARY_OP(Plus, +)
+QUIT_EXPR_BINARY_OP(Minus, -)
+QUIT_EXPR_BINARY_OP(Multiply, *)
+QUIT_EXPR_BINARY_OP(Divide, /)
+#undef QUIT_EXPR_BINARY_OP
+
+/*
+ *  The complex product written out. The built-in one checks for infinities
+ *  and NaNs, which stops the compiler vectorising it. Here those give NaN.
+ */
+struct Times : Multiply {
+	using Multiply::operator();
+	template<typename T>
+	std::complex<T> operator()(const std::complex<T> &x, const std::complex<T> &y) const {
+		return std::complex<T>(x.real()*y.real() - x.imag()*y.imag(), x.real()*y.imag() + x.imag()*y.real());
+	}
+};
+
+#define QUIT_EXPR_UNARY_OP(Name, f) \
+struct Name { \
+	template<typename X> auto operator()(const X &x) const -> decltype(f(x)) { return f(x); } \
+};
+QUIT_EXPR_UNARY_OP(Abs, std::abs)
+QUIT_EXPR_UNARY_OP(Arg, std::arg)
+QUIT_EXPR_UNARY_OP(Conj, std::conj)
+QUIT_EXPR_UNARY_OP(Real, std::real)
+QUIT_EXPR_UNARY_OP(Imag, std::imag)
+QUIT_EXPR_UNARY_OP(Norm, std::norm)
+#undef QUIT_EXPR_UNARY_OP
+
+template<typename Op, typename A, typename B>
+BinaryExpr<Op, typename Lift<A>::type, typename Lift<B>::type> MakeBinary(const A &a, const B &b) {
+	return BinaryExpr<Op, typename Lift<A>::type, typename Lift<B>::type>(Lift<A>::Make(a), Lift<B>::Make(b));
+}
+
+template<typename Op, typename A>
+UnaryExpr<Op, typename Lift<A>::type> MakeUnary(const A &a) {
+	return UnaryExpr<Op, typename Lift<A>::type>(Lift<A>::Make(a));
+}
+
+/*
+ *  Write expression e over the elements of dst, a row at a time. The rows of
+ *  the other dimensions are counted off like the carry iterator.
+ */
+template<typename Tp, size_t rank, typename E>
+void Assign(MultiArray<Tp, rank> &dst, const E &e) {
+	typedef typename MultiArray<Tp, rank>::Index Index;
+	static_assert(!E::Rank || (E::Rank == rank), "MultiArray ranks do not match in expression.");
+	const Index &dims = dst.dims();
+	const Index &strides = dst.strides();
+	e.check(dims);
+	if (dst.size() == 0)
+		return;
+	const size_t nx = dims[0], sx = strides[0], nrows = dst.size() / nx;
+	Tp *const base = dst.data();
+	Index start = Index::Zero();
+	for (size_t r = 0; r < nrows; r++) {
+		const typename E::Row row = e.row(start);
+		Tp *out = base + (start * strides).sum();
+		for (size_t x = 0; x < nx; x++) {
+			out[x * sx] = row[x];
+		}
+		for (size_t d = 1; d < rank; d++) {
+			if (++start[d] < dims[d])
+				break;
+			start[d] = 0;
+		}
+	}
+}
+
+} // End namespace ExprDetail
+
+#define QUIT_EXPR_OPERATOR(op, Name) \
+template<typename A, typename B, typename = typename ExprDetail::EnableBinary<A, B>::type> \
+auto operator op(const A &a, const B &b) -> decltype(ExprDetail::MakeBinary<ExprDetail::Name>(a, b)) { \
+	return ExprDetail::MakeBinary<ExprDetail::Name>(a, b); \
+}
+QUIT_EXPR_OPERATOR(+, Plus)
+QUIT_EXPR_OPERATOR(-, Minus)
+QUIT_EXPR_OPERATOR(*, Times)
+QUIT_EXPR_OPERATOR(/, Divide)
+#undef QUIT_EXPR_OPERATOR
+
+#define QUIT_EXPR_FUNCTION(f, Name) \
+template<typename A, typename = typename std::enable_if<ExprDetail::IsExpr<A>::value>::type> \
+auto f(const A &a) -> decltype(ExprDetail::MakeUnary<ExprDetail::Name>(a)) { \
+	return ExprDetail::MakeUnary<ExprDetail::Name>(a); \
+}
+QUIT_EXPR_FUNCTION(abs, Abs)
+QUIT_EXPR_FUNCTION(arg, Arg)
+QUIT_EXPR_FUNCTION(conj, Conj)
+QUIT_EXPR_FUNCTION(real, Real)
+QUIT_EXPR_FUNCTION(imag, Imag)
+QUIT_EXPR_FUNCTION(norm, Norm)
+#undef QUIT_EXPR_FUNCTION
+
+//! v repeated along every dimension except dim, for use in an expression
+template<size_t dim, typename Tp>
+ExprDetail::BroadcastLeaf<Tp, dim> Broadcast(const Eigen::Array<Tp, Eigen::Dynamic, 1> &v) {
+	return ExprDetail::BroadcastLeaf<Tp, dim>(v);
+}
+
+template<typename Tp, size_t rank>
+template<typename Derived>
+MultiArray<Tp, rank>::MultiArray(const ArrayExpr<Derived> &e) :
+	MultiArray(e.derived().dims(), BufferOptions::Uninitialised())
+{
+	ExprDetail::Assign(*this, e.derived());
+}
+
+template<typename Tp, size_t rank>
+template<typename Derived>
+MultiArray<Tp, rank> &MultiArray<Tp, rank>::operator=(const ArrayExpr<Derived> &e) {
+	ExprDetail::Assign(*this, e.derived());
+	return *this;
+}
+
+#endif // QUIT_MULTIARRAYEXPR_H
@@ -0,0 +1,233 @@
+/*
+ *  MultiArrayStorage.h
+ *  Part of the QUantitative Image Toolbox
+ *
+ *  Copyright (c) 2014 Tobias Wood. All rights reserved.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_MULTIARRAYSTORAGE_H
+#define QUIT_MULTIARRAYSTORAGE_H
+
+#include <map>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ *  How the buffer behind a MultiArray is allocated. Every buffer is aligned to
+ *  Alignment bytes, so rows that start on a multiple of it suit aligned SIMD
+ *  loads.
+ *
+ *  zero        - Fill with zeros, as std::vector would. Turn this off for
+ *                arrays that are about to be completely overwritten, which also
+ *                saves touching every page of a large array twice.
+ *  hugePages   - Ask the kernel for transparent huge pages, which cuts the
+ *                number of page faults on multi-GB arrays. Only applies to
+ *                buffers of at least HugePageSize.
+ *  pooled      - Take the buffer from BufferPool::Shared() and give it back
+ *                when the last MultiArray using it goes, so that successive
+ *                volumes or files of the same size reuse the same memory.
+ */
+struct BufferOptions {
+	enum : size_t { Alignment = 64, HugePageSize = 2 << 20 };
+
+	bool zero, hugePages, pooled;
+
+	BufferOptions(const bool z = true, const bool h = false, const bool p = false) :
+		zero(z), hugePages(h), pooled(p)
+	{}
+
+	static BufferOptions Uninitialised(const bool h = false, const bool p = false) { return BufferOptions(false, h, p); }
+};
+
+/*
+ *  Keeps buffers that are no longer used, by size, and hands them out again
+ *  for the same size. On a miss the idle buffers are freed first, since a new
+ *  size usually means the old ones will not be asked for again and they
+ *  would only add to the peak. capacity limits the idle bytes that are kept.
+ */
+class BufferPool {
+	protected:
+		struct Key {
+			size_t bytes;
+			bool huge;
+			bool operator<(const Key &other) const { return (bytes < other.bytes) || ((bytes == other.bytes) && (huge < other.huge)); }
+		};
+
+		mutable std::mutex m_mutex;
+		std::multimap<Key, void *> m_idle;
+		size_t m_idleBytes, m_capacity;
+
+		static void *AllocateAligned(const Key &key) {
+			void *p = nullptr;
+			const size_t align = key.huge ? BufferOptions::HugePageSize : BufferOptions::Alignment;
+			if (posix_memalign(&p, align, key.bytes) != 0)
+				throw(std::bad_alloc());
+			#ifdef MADV_HUGEPAGE
+			if (key.huge)
+				madvise(p, key.bytes, MADV_HUGEPAGE);
+			#endif
+			return p;
+		}
+
+		void recycle(const Key &key, void *p) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_idleBytes + key.bytes > m_capacity) {
+				free(p);
+			} else {
+				m_idle.insert(std::make_pair(key, p));
+				m_idleBytes += key.bytes;
+			}
+		}
+
+		std::shared_ptr<void> get(const Key &key) {
+			void *p = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto it = m_idle.find(key);
+				if (it != m_idle.end()) {
+					p = it->second;
+					m_idle.erase(it);
+					m_idleBytes -= key.bytes;
+				} else {
+					releaseLocked();
+				}
+			}
+			if (!p)
+				p = AllocateAligned(key);
+			return std::shared_ptr<void>(p, [this, key](void *b) { recycle(key, b); });
+		}
+
+		void releaseLocked() {
+			for (auto &b : m_idle)
+				free(b.second);
+			m_idle.clear();
+			m_idleBytes = 0;
+		}
+
+	public:
+		BufferPool(const size_t capacity = std::numeric_limits<size_t>::max()) : m_idleBytes(0), m_capacity(capacity) {}
+		BufferPool(const BufferPool &) = delete;
+		BufferPool &operator=(const BufferPool &) = delete;
+		~BufferPool() { releaseLocked(); }
+
+		//! Never destroyed, so buffers can be returned to it at any point during exit
+		static BufferPool &Shared() {
+			static BufferPool *pool = new BufferPool();
+			return *pool;
+		}
+
+		/*!
+		 *  A buffer of at least bytes, aligned as the options ask. Its contents
+		 *  are undefined, zeroing is left to the caller that knows the type.
+		 */
+		static std::shared_ptr<void> Allocate(const size_t bytes, const BufferOptions &opts) {
+			const size_t blocks = (bytes + BufferOptions::Alignment - 1) / BufferOptions::Alignment;
+			Key key{(blocks ? blocks : 1) * BufferOptions::Alignment, false};
+			key.huge = opts.hugePages && (key.bytes >= BufferOptions::HugePageSize);
+			if (opts.pooled) {
+				return Shared().get(key);
+			} else {
+				return std::shared_ptr<void>(AllocateAligned(key), free);
+			}
+		}
+
+		size_t idleBytes() const {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_idleBytes;
+		}
+
+		void setCapacity(const size_t bytes) { //!< 0 stops buffers being kept at all
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_capacity = bytes;
+			if (m_idleBytes > m_capacity)
+				releaseLocked();
+		}
+
+		void release() { //!< Free every idle buffer
+			std::lock_guard<std::mutex> lock(m_mutex);
+			releaseLocked();
+		}
+};
+
+/*
+ *  Buffers that are a shared, read-write mapping of a file, so that arrays
+ *  larger than memory are paged to and from the file by the OS. They are only
+ *  as aligned as their offset in the file.
+ */
+class MappedBuffer {
+	protected:
+		static std::runtime_error Error(const std::string &what, const std::string &path, const int err = errno) {
+			return std::runtime_error(what + " " + path + ": " + strerror(err));
+		}
+
+		//! Close fd and throw, with the errno of the call that failed rather than of close
+		[[noreturn]] static void Fail(const int fd, const std::string &what, const std::string &path) {
+			const int err = errno;
+			close(fd);
+			throw(Error(what, path, err));
+		}
+
+		static std::shared_ptr<void> MapFd(const int fd, const std::string &path, const size_t offset, const size_t bytes) {
+			struct stat info;
+			if (fstat(fd, &info) != 0)
+				Fail(fd, "Could not stat", path);
+			if (static_cast<size_t>(info.st_size) < offset + bytes) {
+				// The new part of the file is sparse, so reads as zeros until written
+				if (ftruncate(fd, offset + bytes) != 0)
+					Fail(fd, "Could not extend", path);
+			}
+			if (bytes == 0) { // mmap refuses a length of 0, and there is nothing to map anyway
+				close(fd);
+				return std::shared_ptr<void>();
+			}
+			// mmap needs a page-aligned offset
+			const size_t start = offset & ~(static_cast<size_t>(sysconf(_SC_PAGESIZE)) - 1);
+			const size_t length = bytes + (offset - start);
+			void *base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+			if (base == MAP_FAILED)
+				Fail(fd, "Could not map", path);
+			close(fd); // The mapping keeps the file open
+			return std::shared_ptr<void>(static_cast<char *>(base) + (offset - start), [base, length](void *) { munmap(base, length); });
+		}
+
+	public:
+		/*!
+		 *  Map bytes of path from offset. The file is created if it does not
+		 *  exist and grown if it is too short, anything already there is kept.
+		 *  If bytes is 0 the buffer is null.
+		 */
+		static std::shared_ptr<void> Map(const std::string &path, const size_t offset, const size_t bytes) {
+			const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			if (fd < 0)
+				throw(Error("Could not open", path));
+			return MapFd(fd, path, offset, bytes);
+		}
+
+		//! A new file in dir that is removed straight away, so it goes with the buffer. Starts as zeros.
+		static std::shared_ptr<void> Scratch(const std::string &dir, const size_t bytes) {
+			std::string path = dir + "/multiarray.XXXXXX";
+			const int fd = mkstemp(&path[0]);
+			if (fd < 0)
+				throw(Error("Could not create a scratch file in", dir));
+			unlink(path.c_str());
+			return MapFd(fd, path, 0, bytes);
+		}
+};
+
+#endif // QUIT_MULTIARRAYSTORAGE_H
@@ -0,0 +1,548 @@
+/*
+ *  catalog.cpp
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#include "catalog.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace Agilent {
+
+namespace {
+
+const char CatalogMagic[8] = {'A', 'G', 'P', 'P', 'C', 'A', 'T', 'L'};
+const uint32_t CatalogVersion = 2;
+const uint32_t CatalogEndian = 0x01020304;
+
+/*
+ *  The header is followed by the scan table and the list of parameters the
+ *  catalog was limited to, then each column's values and dictionary aligned to
+ *  8 bytes, then the directory of columns. Everything is in native byte order,
+ *  like procpar caches.
+ */
+struct CatalogHeader {
+	char magic[8];
+	uint32_t version, endian;
+	uint64_t rows, columns, params; //!< params is 0 if every parameter was catalogued
+	uint64_t scans, directory, paramList; //!< Offsets of the scan table, the directory and the parameter list
+};
+
+template<typename T> void Put(string &out, const T &v) {
+	out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+void PutString(string &out, const string &v) {
+	Put(out, static_cast<uint32_t>(v.size()));
+	out.append(v);
+}
+
+void Align(string &out) {
+	out.resize((out.size() + 7) & ~size_t(7), '\0');
+}
+
+template<typename T> T Get(const char *&p, const char *end) {
+	if (static_cast<size_t>(end - p) < sizeof(T))
+		throw(runtime_error("Catalog is truncated"));
+	T v;
+	memcpy(&v, p, sizeof(T));
+	p += sizeof(T);
+	return v;
+}
+
+string GetString(const char *&p, const char *end) {
+	const uint32_t n = Get<uint32_t>(p, end);
+	if (static_cast<size_t>(end - p) < n)
+		throw(runtime_error("Catalog is truncated"));
+	string v(p, n);
+	p += n;
+	return v;
+}
+
+bool Compare(const double a, const Catalog::Op op, const double b) {
+	switch (op) {
+		case Catalog::Op::Equal: return a == b;
+		case Catalog::Op::NotEqual: return a != b;
+		case Catalog::Op::Less: return a < b;
+		case Catalog::Op::LessEqual: return a <= b;
+		case Catalog::Op::Greater: return a > b;
+		case Catalog::Op::GreaterEqual: return a >= b;
+		case Catalog::Op::Contains: break;
+	}
+	throw(runtime_error("~ can only be used on string parameters"));
+}
+
+bool Compare(const string &a, const Catalog::Op op, const string &b) {
+	switch (op) {
+		case Catalog::Op::Equal: return a == b;
+		case Catalog::Op::NotEqual: return a != b;
+		case Catalog::Op::Less: return a < b;
+		case Catalog::Op::LessEqual: return a <= b;
+		case Catalog::Op::Greater: return a > b;
+		case Catalog::Op::GreaterEqual: return a >= b;
+		case Catalog::Op::Contains: return a.find(b) != string::npos;
+	}
+	return false;
+}
+
+} // End anonymous namespace
+
+//******************************************************************************
+#pragma mark Catalog
+//******************************************************************************
+Catalog::Predicate Catalog::Predicate::Parse(const string &text) {
+	const size_t pos = text.find_first_of("=!<>~");
+	if ((pos == 0) || (pos == string::npos))
+		throw(runtime_error("Invalid predicate: " + text));
+	Predicate p;
+	p.name = text.substr(0, pos);
+	size_t len = 1;
+	const bool equals = (pos + 1 < text.size()) && (text[pos + 1] == '=');
+	switch (text[pos]) {
+		case '=': p.op = Op::Equal; break;
+		case '~': p.op = Op::Contains; break;
+		case '!':
+			if (!equals)
+				throw(runtime_error("Invalid predicate: " + text));
+			p.op = Op::NotEqual; len = 2; break;
+		case '<': p.op = equals ? Op::LessEqual : Op::Less; len = equals ? 2 : 1; break;
+		case '>': p.op = equals ? Op::GreaterEqual : Op::Greater; len = equals ? 2 : 1; break;
+	}
+	p.value = text.substr(pos + len);
+	if ((p.value.size() >= 2) && (p.value.front() == '"') && (p.value.back() == '"'))
+		p.value = p.value.substr(1, p.value.size() - 2);
+	return p;
+}
+
+Catalog::Catalog(const string &path) : m_path(path) {
+	const int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw(runtime_error("Could not open catalog: " + path));
+	struct stat info;
+	if ((fstat(fd, &info) != 0) || (static_cast<size_t>(info.st_size) < sizeof(CatalogHeader))) {
+		::close(fd);
+		throw(runtime_error("Not a catalog: " + path));
+	}
+	m_size = info.st_size;
+	void *addr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (addr == MAP_FAILED)
+		throw(runtime_error("Could not map catalog: " + path));
+	const size_t size = m_size;
+	m_data = shared_ptr<const char>(static_cast<const char *>(addr), [size](const char *p) {
+		munmap(const_cast<char *>(p), size);
+	});
+
+	CatalogHeader hdr;
+	memcpy(&hdr, m_data.get(), sizeof(hdr));
+	if (memcmp(hdr.magic, CatalogMagic, sizeof(CatalogMagic)) != 0)
+		throw(runtime_error("Not a catalog: " + path));
+	if ((hdr.version != CatalogVersion) || (hdr.endian != CatalogEndian))
+		throw(runtime_error("Catalog was written by a different version or machine: " + path));
+	if ((hdr.scans > m_size) || (hdr.directory > m_size) || (hdr.paramList > m_size))
+		throw(runtime_error("Catalog is truncated: " + path));
+
+	const char *end = m_data.get() + m_size;
+	const char *p = m_data.get() + hdr.scans;
+	m_scans.resize(hdr.rows);
+	for (auto &s : m_scans) {
+		s.size = Get<uint64_t>(p, end);
+		s.mtime = Get<int64_t>(p, end);
+		s.mtimeNs = Get<int64_t>(p, end);
+		s.path = GetString(p, end);
+	}
+	p = m_data.get() + hdr.paramList;
+	m_params.resize(hdr.params);
+	for (auto &name : m_params)
+		name = GetString(p, end);
+	p = m_data.get() + hdr.directory;
+	m_names.reserve(hdr.columns);
+	for (uint64_t i = 0; i < hdr.columns; i++) {
+		const string name = GetString(p, end);
+		Column c;
+		c.type = static_cast<Parameter::Type>(Get<uint32_t>(p, end));
+		c.offset = Get<uint64_t>(p, end);
+		c.dictOffset = Get<uint64_t>(p, end);
+		c.dictSize = Get<uint64_t>(p, end);
+		const size_t width = (c.type == Parameter::Type::Real) ? sizeof(double) : sizeof(uint32_t);
+		if ((c.offset > m_size) || ((m_size - c.offset) / width < hdr.rows) ||
+		    ((c.type == Parameter::Type::String) &&
+		     ((c.dictOffset > m_size) || ((m_size - c.dictOffset) / sizeof(uint64_t) <= c.dictSize))))
+			throw(runtime_error("Catalog is truncated: " + path));
+		m_names.push_back(name);
+		m_columns[name] = c;
+	}
+	sort(m_names.begin(), m_names.end());
+}
+
+size_t Catalog::rows() const { return m_scans.size(); }
+const Catalog::Scan &Catalog::scan(const size_t row) const { return m_scans.at(row); }
+const vector<string> &Catalog::names() const { return m_names; }
+const vector<string> &Catalog::params() const { return m_params; }
+bool Catalog::contains(const string &name) const { return m_columns.count(name) > 0; }
+Parameter::Type Catalog::type(const string &name) const { return column(name).type; }
+
+const Catalog::Column &Catalog::column(const string &name) const {
+	auto it = m_columns.find(name);
+	if (it == m_columns.end())
+		throw(invalid_argument("Parameter " + name + " is not in catalog " + m_path));
+	return it->second;
+}
+
+const double *Catalog::reals(const Column &c) const {
+	return reinterpret_cast<const double *>(m_data.get() + c.offset);
+}
+
+const uint32_t *Catalog::codes(const Column &c) const {
+	return reinterpret_cast<const uint32_t *>(m_data.get() + c.offset);
+}
+
+string Catalog::entry(const Column &c, const uint32_t code) const {
+	if (code >= c.dictSize)
+		throw(runtime_error("Invalid dictionary entry in catalog " + m_path));
+	const uint64_t *offsets = reinterpret_cast<const uint64_t *>(m_data.get() + c.dictOffset);
+	const char *text = m_data.get() + c.dictOffset + (c.dictSize + 1) * sizeof(uint64_t);
+	if ((offsets[code] > offsets[code + 1]) || (offsets[code + 1] > static_cast<uint64_t>(m_data.get() + m_size - text)))
+		throw(runtime_error("Invalid dictionary entry in catalog " + m_path));
+	return string(text + offsets[code], offsets[code + 1] - offsets[code]);
+}
+
+size_t Catalog::dictionarySize(const string &name) const {
+	const Column &c = column(name);
+	return (c.type == Parameter::Type::String) ? c.dictSize : 0;
+}
+
+bool Catalog::missing(const string &name, const size_t row) const {
+	const Column &c = column(name);
+	if (row >= rows())
+		throw(out_of_range("Row " + to_string(row) + " is out of range"));
+	return (c.type == Parameter::Type::Real) ? std::isnan(reals(c)[row]) : (codes(c)[row] == 0);
+}
+
+double Catalog::realValue(const string &name, const size_t row) const {
+	const Column &c = column(name);
+	if (c.type != Parameter::Type::Real)
+		throw(runtime_error("Parameter " + name + " is not real valued"));
+	if (row >= rows())
+		throw(out_of_range("Row " + to_string(row) + " is out of range"));
+	return reals(c)[row];
+}
+
+string Catalog::stringValue(const string &name, const size_t row) const {
+	const Column &c = column(name);
+	if (c.type != Parameter::Type::String)
+		throw(runtime_error("Parameter " + name + " is not string valued"));
+	if (row >= rows())
+		throw(out_of_range("Row " + to_string(row) + " is out of range"));
+	return entry(c, codes(c)[row]);
+}
+
+string Catalog::print(const string &name, const size_t row) const {
+	if (missing(name, row))
+		return "";
+	if (type(name) == Parameter::Type::String)
+		return stringValue(name, row);
+	stringstream ss;
+	ss.precision(numeric_limits<double>::max_digits10);
+	ss << realValue(name, row);
+	return ss.str();
+}
+
+/*
+ *  Each predicate is a single pass over one column. String predicates are
+ *  evaluated once per dictionary entry, so the pass itself only compares codes.
+ */
+vector<size_t> Catalog::query(const vector<Predicate> &predicates) const {
+	vector<char> keep(rows(), 1);
+	for (auto &p : predicates) {
+		const Column &c = column(p.name);
+		if (c.type == Parameter::Type::Real) {
+			char *end;
+			const double v = strtod(p.value.c_str(), &end);
+			if (p.value.empty() || *end)
+				throw(runtime_error("Parameter " + p.name + " is real valued, but " + p.value + " is not a number"));
+			const double *r = reals(c);
+			for (size_t i = 0; i < keep.size(); i++)
+				keep[i] &= !std::isnan(r[i]) && Compare(r[i], p.op, v);
+		} else {
+			vector<char> accept(c.dictSize, 0);
+			for (uint32_t d = 1; d < c.dictSize; d++)
+				accept[d] = Compare(entry(c, d), p.op, p.value);
+			const uint32_t *codes = this->codes(c);
+			for (size_t i = 0; i < keep.size(); i++) {
+				if (codes[i] >= c.dictSize)
+					throw(runtime_error("Invalid dictionary entry in catalog " + m_path));
+				keep[i] &= accept[codes[i]];
+			}
+		}
+	}
+	vector<size_t> result;
+	for (size_t i = 0; i < keep.size(); i++) {
+		if (keep[i])
+			result.push_back(i);
+	}
+	return result;
+}
+
+//******************************************************************************
+#pragma mark CatalogBuilder
+//******************************************************************************
+CatalogBuilder::CatalogBuilder(const vector<string> &only) : m_only(only) {
+	sort(m_only.begin(), m_only.end());
+	m_only.erase(unique(m_only.begin(), m_only.end()), m_only.end());
+}
+
+const vector<string> &CatalogBuilder::params() const { return m_only; }
+
+size_t CatalogBuilder::rows() const { return m_scans.size(); }
+
+CatalogBuilder::Column *CatalogBuilder::column(const string &name, const Parameter::Type type) {
+	auto it = m_columns.find(name);
+	if (it == m_columns.end()) {
+		Column &c = m_columns[name];
+		c.type = type;
+		c.dict.push_back(""); // Code 0 is missing
+		return &c;
+	}
+	return (it->second.type == type) ? &it->second : nullptr;
+}
+
+void CatalogBuilder::setReal(Column &c, const size_t row, const double v) {
+	c.reals.resize(row, numeric_limits<double>::quiet_NaN());
+	c.reals.push_back(v);
+}
+
+void CatalogBuilder::setString(Column &c, const size_t row, const string &v) {
+	auto it = c.lookup.find(v);
+	uint32_t code;
+	if (it == c.lookup.end()) {
+		code = c.dict.size();
+		c.dict.push_back(v);
+		c.lookup.emplace(v, code);
+	} else {
+		code = it->second;
+	}
+	c.codes.resize(row, 0);
+	c.codes.push_back(code);
+}
+
+void CatalogBuilder::add(const Catalog::Scan &scan, const ProcPar &pp) {
+	const size_t row = m_scans.size();
+	m_scans.push_back(scan);
+	auto addParameter = [&](const string &name) {
+		const Parameter &p = pp.parameter(name);
+		if (p.nvals() == 0)
+			return;
+		Column *c = column(name, p.type());
+		if (!c)
+			return;
+		if (p.type() == Parameter::Type::Real)
+			setReal(*c, row, p.realValue(0));
+		else
+			setString(*c, row, p.stringValue(0));
+	};
+	if (m_only.empty()) {
+		for (size_t i = 0; i < pp.count(); i++)
+			addParameter(pp.name(i));
+	} else {
+		for (auto &name : m_only) {
+			if (pp.contains(name))
+				addParameter(name);
+		}
+	}
+}
+
+void CatalogBuilder::copy(const Catalog &from, const vector<size_t> &rows) {
+	const size_t first = m_scans.size();
+	for (auto r : rows)
+		m_scans.push_back(from.scan(r));
+	for (auto &name : from.names()) {
+		if (!m_only.empty() && (find(m_only.begin(), m_only.end(), name) == m_only.end()))
+			continue;
+		const Catalog::Column &src = from.column(name);
+		Column *c = column(name, src.type);
+		if (!c)
+			continue;
+		if (src.type == Parameter::Type::Real) {
+			const double *reals = from.reals(src);
+			for (size_t i = 0; i < rows.size(); i++) {
+				if (!std::isnan(reals[rows[i]]))
+					setReal(*c, first + i, reals[rows[i]]);
+			}
+		} else {
+			// Look each dictionary entry up once, not once per row
+			const uint32_t *codes = from.codes(src);
+			vector<int64_t> remap(src.dictSize, -1);
+			for (size_t i = 0; i < rows.size(); i++) {
+				const uint32_t code = codes[rows[i]];
+				if (code == 0)
+					continue;
+				if (code >= src.dictSize)
+					throw(runtime_error("Invalid dictionary entry in catalog " + from.m_path));
+				if (remap[code] < 0) {
+					setString(*c, first + i, from.entry(src, code));
+					remap[code] = c->codes.back();
+				} else {
+					c->codes.resize(first + i, 0);
+					c->codes.push_back(remap[code]);
+				}
+			}
+		}
+	}
+}
+
+void CatalogBuilder::write(const string &path) const {
+	const size_t nrows = m_scans.size();
+	vector<size_t> order(nrows);
+	for (size_t i = 0; i < nrows; i++)
+		order[i] = i;
+	sort(order.begin(), order.end(), [this](const size_t a, const size_t b) { return m_scans[a].path < m_scans[b].path; });
+	// Columns copied from an old catalog can end up with no values at all
+	vector<string> names;
+	for (auto &c : m_columns) {
+		const Column &col = c.second;
+		if ((col.type == Parameter::Type::Real) ?
+		    any_of(col.reals.begin(), col.reals.end(), [](const double v) { return !std::isnan(v); }) :
+		    (col.dict.size() > 1))
+			names.push_back(c.first);
+	}
+	sort(names.begin(), names.end());
+
+	CatalogHeader hdr;
+	memcpy(hdr.magic, CatalogMagic, sizeof(CatalogMagic));
+	hdr.version = CatalogVersion;
+	hdr.endian = CatalogEndian;
+	hdr.rows = nrows;
+	hdr.columns = names.size();
+	hdr.params = m_only.size();
+	string out(sizeof(CatalogHeader), '\0');
+	hdr.scans = out.size();
+	for (auto r : order) {
+		Put(out, m_scans[r].size);
+		Put(out, m_scans[r].mtime);
+		Put(out, m_scans[r].mtimeNs);
+		PutString(out, m_scans[r].path);
+	}
+	hdr.paramList = out.size();
+	for (auto &name : m_only)
+		PutString(out, name);
+	string directory;
+	for (auto &name : names) {
+		const Column &c = m_columns.at(name);
+		Align(out);
+		const uint64_t offset = out.size();
+		uint64_t dictOffset = 0, dictSize = 0;
+		// Rows after the last one set are missing, so were never padded
+		if (c.type == Parameter::Type::Real) {
+			for (auto r : order)
+				Put(out, (r < c.reals.size()) ? c.reals[r] : numeric_limits<double>::quiet_NaN());
+		} else {
+			/*
+			 * Codes are handed out in the order values are first seen, which
+			 * differs between full and incremental builds, so sort the
+			 * dictionary and renumber them. Entry 0 stays as missing.
+			 */
+			vector<uint32_t> sorted(c.dict.size()), recode(c.dict.size());
+			for (uint32_t d = 0; d < c.dict.size(); d++)
+				sorted[d] = d;
+			sort(sorted.begin() + 1, sorted.end(), [&c](const uint32_t a, const uint32_t b) { return c.dict[a] < c.dict[b]; });
+			for (uint32_t d = 0; d < sorted.size(); d++)
+				recode[sorted[d]] = d;
+			for (auto r : order)
+				Put(out, (r < c.codes.size()) ? recode[c.codes[r]] : uint32_t(0));
+			Align(out);
+			dictOffset = out.size();
+			dictSize = c.dict.size();
+			uint64_t o = 0;
+			for (auto d : sorted) {
+				Put(out, o);
+				o += c.dict[d].size();
+			}
+			Put(out, o);
+			for (auto d : sorted)
+				out.append(c.dict[d]);
+		}
+		PutString(directory, name);
+		Put(directory, static_cast<uint32_t>(c.type));
+		Put(directory, offset);
+		Put(directory, dictOffset);
+		Put(directory, dictSize);
+	}
+	Align(out);
+	hdr.directory = out.size();
+	out.append(directory);
+	memcpy(&out[0], &hdr, sizeof(hdr));
+
+	const string tmpPath = path + ".tmp" + to_string(getpid());
+	ofstream file(tmpPath, ios::binary);
+	if (!file.write(out.data(), out.size()) || (file.close(), !file)) {
+		std::remove(tmpPath.c_str());
+		throw(runtime_error("Could not write catalog " + path));
+	}
+	if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+		std::remove(tmpPath.c_str());
+		throw(runtime_error("Could not write catalog " + path));
+	}
+}
+
+//******************************************************************************
+#pragma mark Finding bundles
+//******************************************************************************
+namespace {
+
+bool EndsWith(const string &s, const string &end) {
+	return (s.size() >= end.size()) && (s.compare(s.size() - end.size(), end.size(), end) == 0);
+}
+
+void FindBundles(const string &dir, vector<string> &paths) {
+	DIR *dfd = opendir(dir.c_str());
+	if (!dfd)
+		throw(runtime_error("Could not open directory: " + dir));
+	struct dirent *dp;
+	while ((dp = readdir(dfd))) {
+		if (dp->d_name[0] == '.') // Ignore ., .., and hidden files
+			continue;
+		const string path = dir + "/" + dp->d_name;
+		struct stat info;
+		if ((lstat(path.c_str(), &info) != 0) || !S_ISDIR(info.st_mode))
+			continue;
+		if (EndsWith(path, ".fid") || EndsWith(path, ".img")) {
+			const string procpar = path + "/procpar";
+			if (stat(procpar.c_str(), &info) == 0)
+				paths.push_back(procpar);
+		} else {
+			FindBundles(path, paths);
+		}
+	}
+	closedir(dfd);
+}
+
+} // End anonymous namespace
+
+vector<string> FindBundleProcpars(const string &root) {
+	vector<string> paths;
+	string dir = root;
+	while ((dir.size() > 1) && (dir.back() == '/'))
+		dir.pop_back();
+	FindBundles(dir, paths);
+	sort(paths.begin(), paths.end());
+	return paths;
+}
+
+} // End namespace Agilent
@@ -0,0 +1,136 @@
+/*
+ *  catalog.h
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#ifndef AGILENT_CATALOG
+#define AGILENT_CATALOG
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+
+#include "procpar.h"
+
+namespace Agilent {
+
+/*
+ *  A column-oriented index of procpar parameters across many scans, so that
+ *  questions like "which scans had seqfil = mp3rage and nv2 > 200" only need
+ *  to read the columns they mention instead of parsing every procpar again.
+ *
+ *  Each parameter has one column holding its first value for every scan. Real
+ *  columns are doubles, with NaN where a scan does not have the parameter.
+ *  String columns are codes into a sorted dictionary of the distinct values,
+ *  where 0 means missing. The dictionary is a table of offsets then the text,
+ *  so any entry can be read directly. A parameter that is real in some scans
+ *  and a string in others keeps the type it was first seen with, the others
+ *  count as missing.
+ *
+ *  A Catalog maps the file read-only. Use CatalogBuilder to make or update one.
+ */
+class Catalog {
+	public:
+		struct Scan {
+			std::string path;        //!< Of the procpar
+			uint64_t size;           //!< And its size and mtime when it was catalogued
+			int64_t mtime, mtimeNs;
+		};
+
+		enum class Op { Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual, Contains };
+		/*!
+		 *  A test on one column, written as name op value with op one of
+		 *  = != < <= > >= or ~ (contains, strings only). Strings compare as
+		 *  text, and value may be in double quotes. Missing values never match.
+		 */
+		struct Predicate {
+			std::string name, value;
+			Op op;
+			static Predicate Parse(const std::string &text);
+		};
+
+	protected:
+		friend class CatalogBuilder;
+		struct Column {
+			Parameter::Type type;
+			uint64_t offset;           //!< Of the nrows values or codes
+			uint64_t dictOffset, dictSize;
+		};
+
+		std::shared_ptr<const char> m_data;
+		size_t m_size;
+		std::string m_path;
+		std::vector<Scan> m_scans;
+		std::vector<std::string> m_names, m_params;
+		std::unordered_map<std::string, Column> m_columns;
+
+		const Column &column(const std::string &name) const; //!< Throws if it is not there
+		const double *reals(const Column &c) const;
+		const uint32_t *codes(const Column &c) const;
+		std::string entry(const Column &c, const uint32_t code) const; //!< From the dictionary
+
+	public:
+		Catalog(const std::string &path); //!< Throws if path is not a valid catalog
+
+		size_t rows() const;
+		const Scan &scan(const size_t row) const;
+		const std::vector<std::string> &names() const; //!< Parameters, sorted
+		const std::vector<std::string> &params() const; //!< The parameters it was limited to when built, sorted, empty if it was not
+		bool contains(const std::string &name) const;
+		Parameter::Type type(const std::string &name) const;
+		size_t dictionarySize(const std::string &name) const; //!< Of a string column, including the missing entry 0
+
+		bool missing(const std::string &name, const size_t row) const;
+		double realValue(const std::string &name, const size_t row) const;
+		std::string stringValue(const std::string &name, const size_t row) const;
+		std::string print(const std::string &name, const size_t row) const; //!< Empty if missing
+
+		std::vector<size_t> query(const std::vector<Predicate> &predicates) const; //!< Rows that match them all
+};
+
+/*
+ *  Collects scans in memory and writes them as a Catalog. Rows can come from a
+ *  freshly read ProcPar or be copied from an existing catalog, which is how
+ *  unchanged scans are carried over when an archive is re-indexed.
+ */
+class CatalogBuilder {
+	protected:
+		struct Column {
+			Parameter::Type type;
+			std::vector<double> reals;
+			std::vector<uint32_t> codes;
+			std::vector<std::string> dict;
+			std::unordered_map<std::string, uint32_t> lookup;
+		};
+
+		std::vector<Catalog::Scan> m_scans;
+		std::vector<std::string> m_only; //!< If not empty, the only parameters to keep, sorted
+		std::unordered_map<std::string, Column> m_columns;
+
+		Column *column(const std::string &name, const Parameter::Type type); //!< Null if the type conflicts or name is not kept
+		void setReal(Column &c, const size_t row, const double v);
+		void setString(Column &c, const size_t row, const std::string &v);
+
+	public:
+		CatalogBuilder(const std::vector<std::string> &only = {});
+
+		size_t rows() const;
+		const std::vector<std::string> &params() const; //!< As passed to the constructor, sorted and without duplicates
+		void add(const Catalog::Scan &scan, const ProcPar &pp);
+		void copy(const Catalog &from, const std::vector<size_t> &rows); //!< Column by column, as that is how from is laid out
+		void write(const std::string &path) const; //!< Sorted by path, via a temporary file so readers never see half a catalog
+};
+
+/*!
+ *  Every procpar in a .fid or .img bundle under root, sorted. Links are not
+ *  followed, and bundles are not searched for other bundles.
+ */
+std::vector<std::string> FindBundleProcpars(const std::string &root);
+
+} // End namespace Agilent
+
+#endif // AGILENT_CATALOG
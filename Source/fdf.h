@@ -24,6 +24,7 @@
 
 #include "fdfFile.h"
 #include "procpar.h"
+#include "scanGeometry.h"
 
 using namespace std;
 using namespace Eigen;
@@ -41,9 +42,8 @@ class fdfImage {
 		ProcPar m_pp;
 		size_t m_rank, m_slabs, m_echoes, m_images;
 		Array<size_t, 3, 1> m_dim; // x y z
-		Array3d m_voxdim;
 		map<string, shared_ptr<fdfFile>> m_files;
-		Affine3d m_transform;
+		ScanGeometry m_geometry;
 		const string filePath(const size_t slice, const size_t image, const size_t echo) const;
 		
 	public:
@@ -60,6 +60,7 @@ class fdfImage {
 		const size_t voxelsPerSlice() const;
 		const size_t voxelsPerVolume() const;
 		const Affine3d &transform() const;
+		const ScanGeometry &geometry() const;
 		
 		template<typename T>
 		vector<T> readVolume(const size_t vol, const size_t echo = 0) {
@@ -19,7 +19,7 @@
 using namespace std;
 using namespace Eigen;
 
-static bool zip = false, procpar = false, verbose = false, corax = false;
+static bool zip = false, procpar = false, zprocpar = false, verbose = false, corax = false;
 static int echoMode = -1;
 static double scale = 1.;
 static string outPrefix;
@@ -30,11 +30,12 @@ static struct option long_options[] =
 	{"zip", no_argument, 0, 'z'},
 	{"echo", required_argument, 0, 'e'},
 	{"procpar", no_argument, 0, 'p'},
+	{"zprocpar", no_argument, 0, 'P'},
 	{"verbose", no_argument, 0, 'v'},
 	{"corax", no_argument, 0, 'c'},
 	{0, 0, 0, 0}
 };
-static const char *short_options = "s:o:ze:pvc";
+static const char *short_options = "s:o:ze:pPvc";
 
 const string usage {
 "fdf2nii - A utility to convert Agilent fdf files to nifti.\n\
@@ -53,6 +54,7 @@ Options:\n\
 				-3            Average echoes\n\
 				If an echo is chosen beyond the maximum nothing is written.\n\
  -p, --procpar: Embed procpar in the nifti header.\n\
+ -P, --zprocpar: Embed procpar deflate-compressed, procparse can read it back.\n\
  -v, --verbose: Print out extra info (e.g. after each volume is written).\n\
  -c, --corax:   Rotate image orientation so coronal and axial match humans.\n"
 };
@@ -72,6 +74,7 @@ int main(int argc, char **argv) {
 				}
 				break;
 			case 'p': procpar = true; break;
+			case 'P': procpar = zprocpar = true; break;
 			case 'v': verbose = true; break;
 			case 'c': corax = true; break;
 			default: cout << "Unknown option " << optarg << endl;
@@ -123,13 +126,8 @@ int main(int argc, char **argv) {
 				cout << "out.dim(4) " << outHdr.dim(4) << endl;
 				list<Nifti::Extension> exts;
 				if (procpar) {
-					ifstream pp_file(inPath + "/procpar", ios::binary);
-					pp_file.seekg(ios::end);
-					size_t fileSize = pp_file.tellg();
-					pp_file.seekg(ios::beg);
-					vector<char> data; data.reserve(fileSize);
-					data.assign(istreambuf_iterator<char>(pp_file), istreambuf_iterator<char>());
-					exts.emplace_back(NIFTI_ECODE_COMMENT, data);
+					exts.emplace_back(zprocpar ? Agilent::ProcParZipECode : NIFTI_ECODE_COMMENT,
+					                  Agilent::ProcParExtension(inPath + "/procpar", zprocpar));
 				}
 				Nifti::File output(outHdr, outPath, exts);
 				size_t outVol = 0;
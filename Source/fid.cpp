@@ -7,6 +7,7 @@
  */
 
 #include "fid.h"
+#include "fidDecode.h"
 
 namespace Agilent {
 
@@ -23,12 +24,7 @@ FID::FID(const string &path) {
 		throw(runtime_error("Invalid extension for FID Bundle: " + m_bundlePath));
     const string fidPath = m_bundlePath + "/fid";
     const string ppPath = m_bundlePath + "/procpar";
-    ifstream fpp(ppPath);
-    if (!fpp)
-        throw(runtime_error("Could not open " + ppPath));
-	fpp >> m_procpar;
-    if (!fpp.eof())
-        throw(runtime_error("Failed to read entirety of " + ppPath));
+	m_procpar = ProcPar::Load(ppPath); // Throws if it cannot be opened
 	if (!m_procpar.contains("seqcon") || !m_procpar.contains("apptype"))
         throw(runtime_error("No apptype or seqcon found in " + ppPath));
     m_fid.open(fidPath); // This will throw on error
@@ -39,31 +35,73 @@ const string FID::print_info() const {
 	
 	ss << "FID Bundle: " << m_bundlePath << endl
 	   << m_fid.print_header() << endl
-	   << "Procpar contains " << m_procpar.count() << " parameters." << endl;
+	   << "Procpar contains " << m_procpar.count() << " parameters." << endl
+	   << "Decode kernels: " << DecodeKernelName() << endl;
 	return ss.str();
 }
 
 std::vector<complex<float>> FID::readBlock(const int i) {
+    std::vector<complex<float>> block(m_fid.nComplexPerBlock());
+    readBlock(i, block.data());
+    return block;
+}
+
+void FID::readBlock(const int i, complex<float> *out) {
     if ((i > -1) && (i < m_fid.nBlocks())) {
-        return m_fid.readBlock(i);
+        m_fid.readBlock(i, out);
     } else {
         throw(runtime_error(string(__PRETTY_FUNCTION__) + "\nInvalid block number " + to_string(i)));
     }
 }
 
-std::vector<complex<float>> FID::readAllBlocks() {
-    std::vector<complex<float>> all(m_fid.nComplexPerBlock() * m_fid.nBlocks());
+float FID::readNativeBlock(const int i, complex<int16_t> *out) {
+    if ((i > -1) && (i < m_fid.nBlocks())) {
+        return m_fid.readNativeBlock(i, out);
+    } else {
+        throw(runtime_error(string(__PRETTY_FUNCTION__) + "\nInvalid block number " + to_string(i)));
+    }
+}
 
-    int blockOffset = 0;
-    for (int b = 0; b < m_fid.nBlocks(); b++) {
-        std::vector<complex<float>> thisBlock = readBlock(b);
-        for (int k = 0; k < m_fid.nComplexPerBlock(); k++)
-            all[blockOffset + k] = thisBlock[k];
-        blockOffset += m_fid.nComplexPerBlock();
+float FID::readNativeBlock(const int i, complex<int32_t> *out) {
+    if ((i > -1) && (i < m_fid.nBlocks())) {
+        return m_fid.readNativeBlock(i, out);
+    } else {
+        throw(runtime_error(string(__PRETTY_FUNCTION__) + "\nInvalid block number " + to_string(i)));
     }
+}
+
+std::vector<complex<float>> FID::readAllBlocks(const int nthreads) {
+    const size_t blockSize = m_fid.nComplexPerBlock();
+    std::vector<complex<float>> all(blockSize * m_fid.nBlocks());
+    // Blocks are independent, so each thread reads and decodes straight into its slot
+    std::vector<std::vector<char>> scratch(ThreadCount(nthreads));
+    ParallelFor(m_fid.nBlocks(), nthreads, [&](const int b, const int thread) {
+        m_fid.readBlock(b, all.data() + b * blockSize, scratch[thread]);
+    });
     return all;
 }
 
+std::vector<complex<float>> FID::readTraces(const int block, const int first, const int count) {
+    std::vector<complex<float>> traces(static_cast<size_t>(count) * m_fid.nComplexPerTrace());
+    readTraces(block, first, count, traces.data());
+    return traces;
+}
+
+void FID::readTraces(const int block, const int first, const int count, complex<float> *out) {
+    if ((block > -1) && (block < m_fid.nBlocks())) {
+        m_fid.readTraces(block, first, count, out);
+    } else {
+        throw(runtime_error(string(__PRETTY_FUNCTION__) + "\nInvalid block number " + to_string(block)));
+    }
+}
+
+int FID::nBlocks() const { return m_fid.nBlocks(); }
+int FID::nComplexPerBlock() const { return m_fid.nComplexPerBlock(); }
+int FID::nTraces() const { return m_fid.nTraces(); }
+bool FID::waitForBlock(const int i, const double timeout) { return m_fid.waitForBlock(i, timeout); }
+int FID::nComplexPerTrace() const { return m_fid.nComplexPerTrace(); }
+
 const ProcPar &FID::procpar() const { return m_procpar; }
+FIDFile &FID::file() { return m_fid; }
 
 } // End namespace Agilents
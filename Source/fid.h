@@ -35,8 +35,19 @@ class FID {
 		
 		const string print_info() const;
         std::vector<complex<float>> readBlock(const int i);
-        std::vector<complex<float>> readAllBlocks();
+        void readBlock(const int i, complex<float> *out); //!< Decode block i into out, which must hold nComplexPerBlock() values
+        float readNativeBlock(const int i, complex<int16_t> *out); //!< Copy block i without widening to float, returning the scale factor
+        float readNativeBlock(const int i, complex<int32_t> *out);
+        int nBlocks() const;
+        int nComplexPerBlock() const;
+        int nTraces() const;
+        bool waitForBlock(const int i, const double timeout); //!< For a fid still being acquired, wait until block i is on disk, or false if the fid stops growing for timeout (s)
+        int nComplexPerTrace() const;
+        std::vector<complex<float>> readAllBlocks(const int nthreads = 1); //!< nthreads < 1 uses all hardware threads
+        std::vector<complex<float>> readTraces(const int block, const int first, const int count);
+        void readTraces(const int block, const int first, const int count, complex<float> *out);
         const ProcPar &procpar() const;
+        FIDFile &file(); //!< Direct access to the fid, e.g. for scatterBlock() or a BlockPrefetcher
 };
 
 } // End namespace Nrecon
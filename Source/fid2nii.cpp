@@ -10,12 +10,16 @@
 #include <iostream>
 #include <algorithm>
 #include <exception>
+#include <functional>
+#include <mutex>
 #include <getopt.h>
 
 #include "Eigen/Dense"
 #include "unsupported/Eigen/FFT"
 
 #include "fid.h"
+#include "fidPrefetch.h"
+#include "scanGeometry.h"
 #include "niiNifti.h"
 #include "MultiArray.h"
 
@@ -23,28 +27,22 @@ using namespace std;
 using namespace Eigen;
 
 bool verbose = false;
-
-void phase_correct_3(MultiArray<complex<float>, 3> & a, Agilent::FID &fid) {
-    float ppe = fid.procpar().realValue("ppe");
-    float ppe2 = fid.procpar().realValue("ppe2");
-
-    float lpe = fid.procpar().realValue("lpe");
-    float lpe2 = fid.procpar().realValue("lpe2");
-
-    float ph = -2*M_PI*ppe/lpe;
-    float ph2 = -2*M_PI*ppe2/lpe2;
-
-    for (int z = 0; z < a.dims()[2]; z++) {
-        const complex<float> fz = polar(1.f, ph2*z);
-        for (int y = 0; y < a.dims()[1]; y++) {
-            const complex<float> fy = polar(1.f, ph*y);
-            for (int x = 0; x < a.dims()[0]; x++) {
-                complex<float> val = a[{x,y,z}];
-                val = val * fy * fz;
-                a[{x,y,z}] = val;
-            }
-        }
+size_t prefetch = 4; //!< Number of blocks to read ahead
+int threads = 1;     //!< Threads used to read blocks, < 1 means all hardware threads
+double follow = -1;  //!< Seconds to wait for a growing fid, < 0 means the fid is complete
+string scratch;      //!< Directory for k-space scratch files, empty to keep k-space on the heap
+const size_t All = MultiArray<complex<float>, 4>::MaxIndex; //!< Take the whole of a dimension in slice()
+
+/*
+ *  The phase ramp along one k-space dimension that moves the image to the centre
+ *  of the FOV. Broadcast it along that dimension to apply it.
+ */
+ArrayXcf PhaseRamp(const float ph, const int n) {
+    ArrayXcf ramp(n);
+    for (int i = 0; i < n; i++) {
+        ramp[i] = polar(1.f, ph*i);
     }
+    return ramp;
 }
 
 void fft_shift_3(MultiArray<complex<float>, 3> & a) {
@@ -67,7 +65,18 @@ void fft_shift_3(MultiArray<complex<float>, 3> & a) {
         auto octant_1 = a.slice<3>({local_1}, {size_half});
         auto octant_2 = a.slice<3>({local_2}, {size_half});
 
-        std::swap_ranges(octant_1.begin(), octant_1.end(), octant_2.begin());
+        if (a.strides()[0] == 1) {
+            // Rows of the octants are contiguous, so swap them a row at a time
+            const auto &s = a.strides();
+            for (int z = 0; z < z2; z++) {
+                for (int y = 0; y < y2; y++) {
+                    complex<float> *row_1 = octant_1.data() + y*s[1] + z*s[2];
+                    std::swap_ranges(row_1, row_1 + x2, octant_2.data() + y*s[1] + z*s[2]);
+                }
+            }
+        } else {
+            std::swap_ranges(octant_1.begin(), octant_1.end(), octant_2.begin());
+        }
     }
 }
 
@@ -119,7 +128,7 @@ MultiArray<float, 3> Hanning3D(MultiArray<float, 3>::Index dims, const float a)
     const int y_2 = ny / 2;
     const int z_2 = nz / 2;
     const float r_m = sqrt(static_cast<float>(x_2*x_2 + y_2*y_2 + z_2*z_2));
-    MultiArray<float, 3> filter(dims);
+    MultiArray<float, 3> filter(dims, BufferOptions::Uninitialised());
     for (int z = 0; z < nz; z++) {
         for (int y = 0; y < ny; y++) {
             for (int x = 0; x < nx; x++) {
@@ -140,7 +149,7 @@ MultiArray<float, 3> Tukey3D(MultiArray<float, 3>::Index dims, const float a, co
     const int y_2 = ny / 2;
     const int z_2 = nz / 2;
     const float r_m = sqrt(static_cast<float>(x_2*x_2 + y_2*y_2 + z_2*z_2));
-    MultiArray<float, 3> filter(dims);
+    MultiArray<float, 3> filter(dims, BufferOptions::Uninitialised());
     for (int z = 0; z < nz; z++) {
         for (int y = 0; y < ny; y++) {
             for (int x = 0; x < nx; x++) {
@@ -152,121 +161,219 @@ MultiArray<float, 3> Tukey3D(MultiArray<float, 3>::Index dims, const float a, co
     return filter;
 }
 
-void ApplyFilter3D(MultiArray<complex<float>, 3> ks, MultiArray<float, 3> filter);
-void ApplyFilter3D(MultiArray<complex<float>, 3> ks, MultiArray<float, 3> filter) {
-    if ((ks.dims() != filter.dims()).any()) {
-        throw(runtime_error("K-space and filter dimensions do not match."));
-    }
+float ScatterBlock(const Agilent::FIDFile &f, const Agilent::FIDFile::BlockView &b, const vector<size_t> &table, complex<float> *dest) {
+    f.scatterBlock(b, table, dest);
+    return 1.f; // Already scaled
+}
+float ScatterBlock(const Agilent::FIDFile &f, const Agilent::FIDFile::BlockView &b, const vector<size_t> &table, complex<int32_t> *dest) {
+    return f.scatterNativeBlock(b, table, dest);
+}
+float ScatterBlock(const Agilent::FIDFile &f, const Agilent::FIDFile::BlockView &b, const vector<size_t> &table, complex<int16_t> *dest) {
+    return f.scatterNativeBlock(b, table, dest);
+}
 
-    auto k_it = ks.begin();
-    auto f_it = filter.begin();
-    while (k_it != ks.end()) {
-        *k_it = (*k_it) * (*f_it);
-        k_it++;
-        f_it++;
+/*
+ *  Decode the first nblocks blocks of the fid straight into k-space, so that trace t
+ *  of block b lands at k + b*blockStride + table[t], then call finished(b, mult).
+ *  mult converts the block's samples to float, and is 1 if Tp is float. With one
+ *  thread, or when following a growing fid, the blocks are done in order while a
+ *  background thread reads the next few. Otherwise they are read and decoded in
+ *  parallel, so finished must only touch its own block's part of k-space.
+ */
+template<typename Tp, typename F>
+void ScatterBlocks(Agilent::FID &fid, const int nblocks, const vector<size_t> &table, const size_t blockStride, complex<Tp> *k, F finished) {
+    // Following needs the blocks in order, so it only gets one thread
+    const int nthreads = (follow >= 0) ? 1 : min(Agilent::ThreadCount(threads), nblocks);
+    if (verbose) cout << "Reading " << nblocks << " blocks with " << nthreads << " threads" << endl;
+    if (nthreads == 1) {
+        Agilent::BlockPrefetcher blocks(fid.file(), 0, nblocks, prefetch, follow);
+        for (int b = 0; b < nblocks; b++) {
+            if (verbose) cout << "Reading block " << b << endl;
+            const float mult = ScatterBlock(fid.file(), blocks.next(), table, k + b * blockStride);
+            finished(b, mult);
+        }
+    } else {
+        vector<vector<char>> scratch(nthreads);
+        Agilent::ParallelFor(nblocks, nthreads, [&](const int b, const int t) {
+            const float mult = ScatterBlock(fid.file(), fid.file().scatterView(b, scratch[t]), table, k + b * blockStride);
+            finished(b, mult);
+        });
     }
 }
 
-MultiArray<complex<float>, 4> reconMGE(Agilent::FID &fid);
-MultiArray<complex<float>, 4> reconMGE(Agilent::FID &fid) {
-    int nx = fid.procpar().realValue("np") / 2;
-    int ny = fid.procpar().realValue("nv");
-    int nz = fid.procpar().realValue("nv2");
-    int narray = fid.procpar().realValue("arraydim");
-    int ne = fid.procpar().realValue("ne");
+template<typename Tp> using VolumeFn = function<void(MultiArray<complex<Tp>, 3>, const int)>; //!< Called with each volume once its k-space is complete
+template<typename Tp> void IgnoreVolume(MultiArray<complex<Tp>, 3>, const int) {}
+
+/*
+ *  Allocates k-space of the given size. zero is true if the recon relies on
+ *  samples it does not write being 0.
+ */
+template<typename Tp> using KSpaceFn = function<MultiArray<complex<Tp>, 4>(const typename MultiArray<complex<Tp>, 4>::Index &, const bool)>;
+template<typename Tp>
+MultiArray<complex<Tp>, 4> NewKSpace(const typename MultiArray<complex<Tp>, 4>::Index &dims, const bool zero) {
+    if (scratch.empty()) {
+        return MultiArray<complex<Tp>, 4>(dims, BufferOptions(zero, true, true));
+    } else {
+        if (verbose) cout << "Mapping k-space onto a scratch file in " << scratch << endl;
+        return MultiArray<complex<Tp>, 4>::MapScratch(dims, scratch);
+    }
+}
 
-    MultiArray<complex<float>, 4> vols({nx, ny, nz, narray*ne});
-    int vol = 0;
+/*
+ *  The recon functions assemble k-space in samples of type Tp. mult(z, v) is the
+ *  factor that converts slice z of volume v to float, and is 1 if Tp is float.
+ */
+template<typename Tp>
+MultiArray<complex<Tp>, 4> reconMGE(Agilent::FID &fid, const Agilent::ScanGeometry &geom, const KSpaceFn<Tp> &alloc, const VolumeFn<Tp> &done, ArrayXXf &mult) {
+    const size_t nx = geom.np;
+    const size_t ny = geom.dims[1];
+    const size_t nz = geom.dims[2];
+    const size_t narray = geom.arrayDim;
+    const size_t ne = geom.echoes;
+    if ((fid.nTraces() != static_cast<int>(ny*nz*ne)) || (fid.nComplexPerTrace() != static_cast<int>(nx)))
+        throw(runtime_error("fid block size does not match procpar"));
+
+    // Every sample is written by the scatter, so there is no need to zero it
+    MultiArray<complex<Tp>, 4> vols = alloc({nx, ny, nz, narray*ne}, false);
+    mult = ArrayXXf::Ones(nz, narray*ne);
     if (verbose) cout << "Reading MGE fid" << endl;
-    for (int a = 0; a < narray; a++) {
-        if (verbose) cout << "Reading block " << a << endl;
-        shared_ptr<vector<complex<float>>> block = make_shared<vector<complex<float>>>();
-        *block = fid.readBlock(a);
-        int e_offset = 0;
-        for (int e = 0; e < ne; e++) {
-            if (verbose)  cout << "Reading echo " << e << endl;
-            MultiArray<complex<float>, 3> this_vol({nx, ny, nz}, block, {1,ne*nx,ne*nx*ny}, e_offset);
-            MultiArray<complex<float>, 3> slice = vols.slice<3>({0,0,0,vol},{-1,-1,-1,0});
-
-            auto it1 = this_vol.begin();
-            auto it2 = slice.begin();
-            while (it1 != this_vol.end()) {
-                *it2++ = *it1++;
+    // Echoes are interleaved within each phase-encode line, and each block holds
+    // every echo for one array element
+    vector<size_t> table(fid.nTraces());
+    for (size_t z = 0; z < nz; z++) {
+        for (size_t y = 0; y < ny; y++) {
+            for (size_t e = 0; e < ne; e++) {
+                table[(z*ny + y)*ne + e] = ((e*nz + z)*ny + y)*nx;
             }
-            vol++;
-            e_offset += nx;
         }
     }
+    ScatterBlocks(fid, narray, table, ne*nz*ny*nx, vols.data(), [&](const int a, const float m) {
+        for (size_t e = 0; e < ne; e++) {
+            mult.col(a*ne + e).setConstant(m);
+            done(vols.template slice<3>({0,0,0,a*ne + e},{All,All,All,0}), a*ne + e);
+        }
+    });
     return vols;
 }
 
-MultiArray<complex<float>, 4> reconMP2RAGE(Agilent::FID &fid);
-MultiArray<complex<float>, 4> reconMP2RAGE(Agilent::FID &fid) {
-    float echo_fraction = 1.0;
-    try {
-        echo_fraction = fid.procpar().realValue("echo_fraction");
-    } catch (exception &e) {
-    
-    }
-    const int nx = fid.procpar().realValue("np") / (2 * echo_fraction);
-    const int e_start = (1 - echo_fraction) * nx;
-    const int ny = fid.procpar().realValue("nv");
-    const int nz = fid.procpar().realValue("nv2");
-    const int nseg = fid.procpar().realValue("nseg");
+template<typename Tp>
+MultiArray<complex<Tp>, 4> reconMP2RAGE(Agilent::FID &fid, const Agilent::ScanGeometry &geom, const KSpaceFn<Tp> &alloc, const VolumeFn<Tp> &done, ArrayXXf &mult) {
+    const float echo_fraction = geom.echoFraction;
+    const int nx = geom.dims[0];
+    const int e_start = nx - geom.np;
+    const int ny = geom.dims[1];
+    const int nz = geom.dims[2];
+    const int nseg = geom.segments;
     const int ny_per_seg = ny / nseg;
     const int nti = (fid.procpar().stringValue("mp3rage_flag") == "y") ? 3 : 2;
-    ArrayXi pelist = fid.procpar().realValues("pelist").cast<int>();
-    MultiArray<complex<float>, 4> k({nx, ny, nz, nti});
+    const ArrayXi &pelist = geom.pelist;
+    if ((fid.nTraces() != nseg*nti*ny_per_seg) || (fid.nComplexPerTrace() != (nx - e_start)))
+        throw(runtime_error("fid block size does not match procpar"));
+    if (pelist.size() < nseg*ny_per_seg)
+        throw(runtime_error("pelist is missing or too short"));
+    MultiArray<complex<Tp>, 4> k = alloc({nx, ny, nz, nti}, true);
+    mult = ArrayXXf::Ones(nz, nti);
 
     if (verbose) {
         cout << "Reading mp3rage fid" << endl;
         cout << "Expecting " << nti << " inversion times" << endl;
         cout << "Echo fraction: " << echo_fraction << endl;
     }
-    for (int z = 0; z < nz; z++) {
-        if (verbose) cout << "Reading block " << z << endl;
-        vector<complex<float>> block = fid.readBlock(z);
-
-        int i = 0;
-        int yseg = 0;
-        for (int s = 0; s < nseg; s++) {
-            for (int v = 0; v < nti; v++) {
-                for (int y = 0; y < (ny / nseg); y++) {
-                    int yind = ny / 2 + pelist[yseg + y];
-                    for (int x = e_start; x < nx; x++) {
-                        k[{x, yind, z, v}] = block.at(i++);
-                    }
-                    for (int x = 0; x < e_start; x++) {
-                        k[{x, yind, z, v}] = conj(k[{nx-x-1, yind, z, v}]);
-                    }
+    // Each block is one slice of every inversion time, acquired segment by segment
+    vector<size_t> table(fid.nTraces());
+    int i = 0;
+    int yseg = 0;
+    for (int s = 0; s < nseg; s++) {
+        for (int v = 0; v < nti; v++) {
+            for (int y = 0; y < ny_per_seg; y++) {
+                const int yind = ny / 2 + pelist[yseg + y];
+                if ((yind < 0) || (yind >= ny))
+                    throw(runtime_error("pelist entry " + to_string(pelist[yseg + y]) + " is outside k-space"));
+                table[i++] = ((static_cast<size_t>(v) * nz * ny) + yind) * nx + e_start;
+            }
+        }
+        yseg += ny_per_seg;
+    }
+    ScatterBlocks(fid, nz, table, static_cast<size_t>(ny) * nx, k.data(), [&](const int z, const float m) {
+        mult.row(z).setConstant(m);
+        // Fill in the unacquired start of each partial echo by conjugate symmetry
+        for (int v = 0; v < nti; v++) {
+            for (int y = 0; y < ny; y++) {
+                for (int x = 0; x < e_start; x++) {
+                    const complex<Tp> mirror = k(nx-x-1, y, z, v);
+                    k(x, y, z, v) = complex<Tp>(mirror.real(), -mirror.imag());
                 }
             }
-            yseg += ny_per_seg;
         }
+    });
+    // Nothing is complete until the end
+    for (int v = 0; v < nti; v++) {
+        done(k.template slice<3>({0,0,0,v},{All,All,All,0}), v);
     }
-
     return k;
 }
 
+template<typename Tp>
+MultiArray<complex<Tp>, 4> recon(Agilent::FID &fid, const Agilent::ScanGeometry &geom, const string &seqfil, const KSpaceFn<Tp> &alloc, const VolumeFn<Tp> &done, ArrayXXf &mult) {
+    if (seqfil.substr(0, 5) == "mge3d") {
+        return reconMGE<Tp>(fid, geom, alloc, done, mult);
+    } else if (seqfil.substr(0, 7) == "mp3rage") {
+        return reconMP2RAGE<Tp>(fid, geom, alloc, done, mult);
+    } else {
+        throw(runtime_error("Recon for " + seqfil + " not implemented"));
+    }
+}
+
+/*
+ *  Convert native k-space to float one volume at a time, just before it is
+ *  filtered and FFT'd, and write each volume out as soon as it is finished.
+ */
+template<typename Tp>
+void writeNative(Nifti::File &output, const MultiArray<complex<Tp>, 4> &k, const ArrayXXf &mult, const VolumeFn<float> &finish) {
+    const auto &d = k.dims();
+    MultiArray<complex<float>, 3> vol({d[0], d[1], d[2]}, BufferOptions::Uninitialised(true, true));
+    for (size_t v = 0; v < d[3]; v++) {
+        complex<float> *it = vol.packedBegin();
+        for (size_t z = 0; z < d[2]; z++) {
+            const float m = mult(z, v);
+            for (size_t y = 0; y < d[1]; y++) {
+                for (size_t x = 0; x < d[0]; x++) {
+                    const complex<Tp> &val = k(x, y, z, v);
+                    *it++ = complex<float>(val.real() * m, val.imag() * m);
+                }
+            }
+        }
+        finish(vol, v);
+        output.writeVolumes(vol.packedBegin(), vol.packedEnd(), v, 1);
+    }
+}
+
 enum class Filters { None, Hanning, Tukey };
 static struct option long_options[] = {
     {"out", required_argument, 0, 'o'},
     {"zip", no_argument, 0, 'z'},
     {"kspace", required_argument, 0, 'k'},
     {"procpar", no_argument, 0, 'p'},
+    {"zprocpar", no_argument, 0, 'P'},
     {"filter", required_argument, 0, 'f'},
     {"mag", no_argument, 0, 'm'},
     {"fa", required_argument, 0, 'a'},
     {"fq", required_argument, 0, 'q'},
     {"verbose", no_argument, 0, 'v'},
+    {"prefetch", required_argument, 0, 'r'},
+    {"threads", required_argument, 0, 'j'},
+    {"follow", required_argument, 0, 'F'},
+    {"native", no_argument, 0, 'n'},
+    {"scratch", required_argument, 0, 't'},
     {0, 0, 0, 0}
 };
-static const char *short_options = "o:zs:kmpf:v";
+static const char *short_options = "o:zs:kmpPf:vr:j:F:nt:";
 const string usage {
 "fid2nii - A utility to reconstruct Agilent fid bundles in nifti format.\n\
 \n\
 Usage: fid2nii [opts] image1 image2 ... imageN\n\
-image1 to imageN are paths to the Agilent .fid folders\n\
+image1 to imageN are paths to the Agilent .fid folders. These may contain\n\
+fid.gz or fid.zst instead of fid, which is decompressed as it is read.\n\
 Options:\n\
     --verbose, -v  : Print out extra info (e.g. after each volume is written).\n\
     --out, -o      : Specify an output prefix.\n\
@@ -274,17 +381,31 @@ Options:\n\
     --mag, -m      : Save magnitude images, not complex.\n\
     --scale, -s N  : Multiply image dimensions by N (set to 10 for use with SPM).\n\
     --procpar, -p  : Embed procpar in the nifti header.\n\
+    --zprocpar, -P : Embed procpar deflate-compressed, procparse can read it back.\n\
     --kspace, -k   : Don't FFT, write out k-space instead.\n\
     --filter, -f h : Use a Hanning filter.\n\
                  t : Use a Tukey filter.\n\
     --fa=X         : Specify the filter alpha parameter.\n\
-    --fq=X         : Specify the q parameter (Tukey only)."
+    --fq=X         : Specify the q parameter (Tukey only).\n\
+    --prefetch, -r N : Read N blocks ahead on a background thread (default 4).\n\
+                       Used with one thread or --follow.\n\
+    --threads, -j N  : Read and decode blocks with N threads (0 for all cores).\n\
+    --follow, -F N   : Reconstruct while the fid is still being acquired, giving\n\
+                       up if it has not grown for N seconds.\n\
+    --native, -n     : Keep integer k-space in its stored width until each volume\n\
+                       is FFT'd. Uses up to 4x less memory, but volumes are only\n\
+                       processed once every block has been read.\n\
+    --scratch, -t DIR : Keep k-space in files mapped into memory instead of on the\n\
+                       heap, so that datasets larger than RAM can be reconstructed.\n\
+                       Complex float k-space is mapped straight onto the output's\n\
+                       voxels if that is an uncompressed .nii, otherwise it goes\n\
+                       in a scratch file in DIR."
 };
 
 int main(int argc, char **argv) {
     int indexptr = 0, c;
     string outPrefix = "";
-    bool zip = false, kspace = false, procpar = false;
+    bool zip = false, kspace = false, procpar = false, zprocpar = false, native = false;
     Filters filterType = Filters::None;
     float f_a = 0, f_q = 0;
     Nifti::DataType dtype = Nifti::DataType::COMPLEX64;
@@ -329,7 +450,19 @@ int main(int argc, char **argv) {
             f_q = atof(optarg);
             break;
         case 'p': procpar = true; break;
+        case 'P': procpar = zprocpar = true; break;
         case 'v': verbose = true; break;
+        case 'r':
+            if (atoi(optarg) < 1) {
+                cerr << "Prefetch depth must be at least 1" << endl;
+                return EXIT_FAILURE;
+            }
+            prefetch = atoi(optarg);
+            break;
+        case 'j': threads = atoi(optarg); break;
+        case 'F': follow = atof(optarg); break;
+        case 'n': native = true; break;
+        case 't': scratch = string(optarg); break;
         case '?': // getopt will print an error message
             cout << usage << endl;
             return EXIT_FAILURE;
@@ -366,6 +499,12 @@ int main(int argc, char **argv) {
             cerr << "apptype " << apptype << " not supported, skipping." << endl;
             continue;
         }
+        if ((seqfil.substr(0, 5) != "mge3d") && (seqfil.substr(0, 7) != "mp3rage")) {
+            cerr << "Recon for " << seqfil << " not implemented, skipping." << endl;
+            continue;
+        }
+
+        const Agilent::ScanGeometry geom(fid.procpar());
 
         if (verbose) {
             cout << fid.print_info() << endl;
@@ -374,74 +513,111 @@ int main(int argc, char **argv) {
         }
 
         /*
-         * Assemble k-Space
-         */
-        MultiArray<complex<float>, 4> vols;
-        if (seqfil.substr(0, 5) == "mge3d") {
-            vols = reconMGE(fid);
-        } else if (seqfil.substr(0, 7) == "mp3rage") {
-            vols = reconMP2RAGE(fid);
-        } else {
-            cerr << "Recon for " << seqfil << " not implemented, skipping." << endl;
-            continue;
-        }
-
-        /*
-         * Build and apply filter
+         * Filter and FFT each volume as soon as all of its k-space has been read
          */
         MultiArray<float, 3> filter;
-        switch (filterType) {
-        case Filters::None: break;
-        case Filters::Hanning:
-            if (verbose) cout << "Building Hanning filter" << endl;
-            filter = Hanning3D(vols.dims().head(3), f_a);
-            break;
-        case Filters::Tukey:
-            if (verbose) cout << "Building Tukey filter" << endl;
-            filter = Tukey3D(vols.dims().head(3), f_a, f_q);
-            break;
-        }
-        if (filterType != Filters::None) {
-            if (verbose) cout << "Applying filter" << endl;
-            for (int v = 0; v < vols.dims()[3]; v++) {
-                MultiArray<complex<float>, 3> vol = vols.slice<3>({0,0,0,v},{-1,-1,-1,0});
-                ApplyFilter3D(vol,filter);
+        once_flag filterBuilt;
+        auto finishVolume = [&](MultiArray<complex<float>, 3> vol, const int v) {
+            if (filterType != Filters::None) {
+                call_once(filterBuilt, [&]() {
+                    switch (filterType) {
+                    case Filters::None: break;
+                    case Filters::Hanning:
+                        if (verbose) cout << "Building Hanning filter" << endl;
+                        filter = Hanning3D(vol.dims(), f_a);
+                        break;
+                    case Filters::Tukey:
+                        if (verbose) cout << "Building Tukey filter" << endl;
+                        filter = Tukey3D(vol.dims(), f_a, f_q);
+                        break;
+                    }
+                });
             }
-        }
-        /*
-         * FFT
-         */
-        if (!kspace) {
-            for (int v = 0; v < vols.dims()[3]; v++) {
+            // The filter and phase correction are applied in a single pass
+            if (kspace) {
+                if (filterType != Filters::None) {
+                    if (verbose) cout << "Applying filter to vol " << v << endl;
+                    vol = vol * filter;
+                }
+            } else {
+                const auto ramp_y = Broadcast<1>(PhaseRamp(geom.phaseRamp[1], vol.dims()[1]));
+                const auto ramp_z = Broadcast<2>(PhaseRamp(geom.phaseRamp[2], vol.dims()[2]));
+                if (filterType != Filters::None) {
+                    if (verbose) cout << "Applying filter to vol " << v << endl;
+                    vol = vol * filter * (ramp_y * ramp_z);
+                } else {
+                    vol = vol * (ramp_y * ramp_z);
+                }
                 if (verbose) cout << "FFTing vol " << v << endl;
-                MultiArray<complex<float>, 3> vol = vols.slice<3>({0,0,0,v},{-1,-1,-1,0});
-                phase_correct_3(vol, fid);
                 fft_shift_3(vol);
                 fft_X(vol);
                 fft_Y(vol);
                 fft_Z(vol);
                 fft_shift_3(vol);
             }
-        }
+        };
 
-        if (verbose) cout << "Writing file: " << outPath << endl;
         list<Nifti::Extension> exts;
         if (procpar) {
             if (verbose) cout << "Embedding procpar" << endl;
-            ifstream pp_file(inPath + "/procpar", ios::binary);
-            pp_file.seekg(ios::end);
-            size_t fileSize = pp_file.tellg();
-            pp_file.seekg(ios::beg);
-            vector<char> data; data.reserve(fileSize);
-            data.assign(istreambuf_iterator<char>(pp_file), istreambuf_iterator<char>());
-            exts.emplace_back(NIFTI_ECODE_COMMENT, data);
+            exts.emplace_back(zprocpar ? Agilent::ProcParZipECode : NIFTI_ECODE_COMMENT,
+                              Agilent::ProcParExtension(inPath + "/procpar", zprocpar));
         }
-        Affine3f xform  = scale * fid.procpar().calcTransform();
+        Affine3f xform  = scale * geom.transform.cast<float>();
         ArrayXf voxdims = (Affine3f(xform.rotation()).inverse() * xform).matrix().diagonal();
-        Nifti::Header outHdr(vols.dims(), voxdims, dtype);
-        outHdr.setTransform(xform);
-        Nifti::File output(outHdr, outPath, exts);
-        output.writeVolumes(vols.begin(), vols.end(), 0, vols.dims()[3]);
+        Nifti::File output;
+        auto openOutput = [&](const MultiArray<complex<float>, 4>::Index &dims) {
+            if (verbose) cout << "Writing file: " << outPath << endl;
+            Nifti::Header outHdr(dims, voxdims, dtype);
+            outHdr.setTransform(xform);
+            output.setHeader(outHdr);
+            output.setExtensions(exts);
+            output.open(outPath, Nifti::Mode::Write);
+        };
+
+        /*
+         * Assemble k-Space. Float k-space is filtered and FFT'd in place, so with
+         * --scratch it can be the output's voxels, which are then already written.
+         */
+        const Agilent::FIDFile::FIDType storage = native ? fid.file().dataType() : Agilent::FIDFile::Float32Type;
+        const bool mapOutput = !scratch.empty() && !zip && (dtype == Nifti::DataType::COMPLEX64);
+        auto floatKSpace = [&](const MultiArray<complex<float>, 4>::Index &dims, const bool zero) {
+            if (!mapOutput)
+                return NewKSpace<float>(dims, zero);
+            openOutput(dims);
+            if (verbose) cout << "Mapping k-space onto the voxels of " << output.imagePath() << endl;
+            return MultiArray<complex<float>, 4>::MapFile(dims, output.imagePath(), output.header().voxoffset());
+        };
+        MultiArray<complex<float>, 4> vols;
+        MultiArray<complex<int32_t>, 4> k32;
+        MultiArray<complex<int16_t>, 4> k16;
+        ArrayXXf mult;
+        MultiArray<complex<float>, 4>::Index dims;
+        switch (storage) {
+        case Agilent::FIDFile::Float32Type:
+            vols = recon<float>(fid, geom, seqfil, floatKSpace, finishVolume, mult);
+            dims = vols.dims();
+            break;
+        case Agilent::FIDFile::Int32Type:
+            k32 = recon<int32_t>(fid, geom, seqfil, NewKSpace<int32_t>, IgnoreVolume<int32_t>, mult);
+            dims = k32.dims();
+            break;
+        case Agilent::FIDFile::Int16Type:
+            k16 = recon<int16_t>(fid, geom, seqfil, NewKSpace<int16_t>, IgnoreVolume<int16_t>, mult);
+            dims = k16.dims();
+            break;
+        }
+
+        if (!output)
+            openOutput(dims);
+        switch (storage) {
+        case Agilent::FIDFile::Float32Type:
+            if (!mapOutput)
+                output.writeVolumes(vols.packedBegin(), vols.packedEnd(), 0, dims[3]);
+            break;
+        case Agilent::FIDFile::Int32Type: writeNative(output, k32, mult, finishVolume); break;
+        case Agilent::FIDFile::Int16Type: writeNative(output, k16, mult, finishVolume); break;
+        }
         output.close();
     }
     return 0;
@@ -0,0 +1,214 @@
+/*
+ *  fidDecode.cpp
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#include "fidDecode.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AGILENT_DECODE_X86
+#include <immintrin.h>
+#endif
+
+namespace Agilent {
+
+namespace {
+
+typedef void (*KernelFn)(const char *, float *, const size_t, const float);
+
+/*
+ *  Scalar fallbacks, also used for the tails of the vector loops
+ */
+inline uint16_t bswap(uint16_t v) { return __builtin_bswap16(v); }
+inline uint32_t bswap(uint32_t v) { return __builtin_bswap32(v); }
+
+template<typename T, typename U, bool Swap>
+void DecodeScalar(const char *src, float *dst, const size_t n, const float mult) {
+	static_assert(sizeof(T) == sizeof(U), "Sample and swap types must be the same size");
+	for (size_t i = 0; i < n; i++) {
+		U bits;
+		memcpy(&bits, src + i * sizeof(U), sizeof(U));
+		if (Swap) bits = bswap(bits);
+		T val;
+		memcpy(&val, &bits, sizeof(T));
+		dst[i] = static_cast<float>(val) * mult;
+	}
+}
+
+#ifdef AGILENT_DECODE_X86
+/*
+ *  SSE4.1 kernels, 4 or 8 samples per iteration
+ */
+template<bool Swap> __attribute__((target("sse4.1")))
+void Int16SSE(const char *src, float *dst, const size_t n, const float mult) {
+	const __m128i shuf = _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+	const __m128 m = _mm_set1_ps(mult);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 2));
+		if (Swap) v = _mm_shuffle_epi8(v, shuf);
+		const __m128 lo = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(v));
+		const __m128 hi = _mm_cvtepi32_ps(_mm_cvtepi16_epi32(_mm_srli_si128(v, 8)));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(lo, m));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(hi, m));
+	}
+	DecodeScalar<int16_t, uint16_t, Swap>(src + i * 2, dst + i, n - i, mult);
+}
+
+template<bool Swap> __attribute__((target("sse4.1")))
+void Int32SSE(const char *src, float *dst, const size_t n, const float mult) {
+	const __m128i shuf = _mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+	const __m128 m = _mm_set1_ps(mult);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+		if (Swap) v = _mm_shuffle_epi8(v, shuf);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), m));
+	}
+	DecodeScalar<int32_t, uint32_t, Swap>(src + i * 4, dst + i, n - i, mult);
+}
+
+template<bool Swap> __attribute__((target("sse4.1")))
+void Float32SSE(const char *src, float *dst, const size_t n, const float mult) {
+	const __m128i shuf = _mm_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+	const __m128 m = _mm_set1_ps(mult);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+		if (Swap) v = _mm_shuffle_epi8(v, shuf);
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_castsi128_ps(v), m));
+	}
+	DecodeScalar<float, uint32_t, Swap>(src + i * 4, dst + i, n - i, mult);
+}
+
+/*
+ *  AVX2 kernels, 8 or 16 samples per iteration. The byte shuffle works within
+ *  each 128-bit lane, which is all a byte swap needs.
+ */
+template<bool Swap> __attribute__((target("avx2")))
+void Int16AVX2(const char *src, float *dst, const size_t n, const float mult) {
+	const __m256i shuf = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+	                                      1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+	const __m256 m = _mm256_set1_ps(mult);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 2));
+		if (Swap) v = _mm256_shuffle_epi8(v, shuf);
+		const __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)));
+		const __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1)));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(lo, m));
+		_mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(hi, m));
+	}
+	DecodeScalar<int16_t, uint16_t, Swap>(src + i * 2, dst + i, n - i, mult);
+}
+
+template<bool Swap> __attribute__((target("avx2")))
+void Int32AVX2(const char *src, float *dst, const size_t n, const float mult) {
+	const __m256i shuf = _mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+	                                      3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+	const __m256 m = _mm256_set1_ps(mult);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+		if (Swap) v = _mm256_shuffle_epi8(v, shuf);
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), m));
+	}
+	DecodeScalar<int32_t, uint32_t, Swap>(src + i * 4, dst + i, n - i, mult);
+}
+
+template<bool Swap> __attribute__((target("avx2")))
+void Float32AVX2(const char *src, float *dst, const size_t n, const float mult) {
+	const __m256i shuf = _mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+	                                      3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+	const __m256 m = _mm256_set1_ps(mult);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+		if (Swap) v = _mm256_shuffle_epi8(v, shuf);
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_castsi256_ps(v), m));
+	}
+	DecodeScalar<float, uint32_t, Swap>(src + i * 4, dst + i, n - i, mult);
+}
+#endif
+
+/*
+ *  Runtime dispatch, resolved once on first use
+ */
+enum class ISA { Scalar, SSE41, AVX2 };
+
+ISA DetectISA() {
+#ifdef AGILENT_DECODE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return ISA::AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return ISA::SSE41;
+#endif
+	return ISA::Scalar;
+}
+
+ISA HostISA() {
+	static const ISA isa = DetectISA();
+	return isa;
+}
+
+struct KernelSet {
+	KernelFn int16[2], int32[2], float32[2]; // Indexed by swap
+};
+
+KernelSet SelectKernels() {
+	KernelSet k = {{DecodeScalar<int16_t, uint16_t, false>, DecodeScalar<int16_t, uint16_t, true>},
+	               {DecodeScalar<int32_t, uint32_t, false>, DecodeScalar<int32_t, uint32_t, true>},
+	               {DecodeScalar<float, uint32_t, false>,   DecodeScalar<float, uint32_t, true>}};
+#ifdef AGILENT_DECODE_X86
+	switch (HostISA()) {
+		case ISA::AVX2:
+			k = {{Int16AVX2<false>, Int16AVX2<true>},
+			     {Int32AVX2<false>, Int32AVX2<true>},
+			     {Float32AVX2<false>, Float32AVX2<true>}};
+			break;
+		case ISA::SSE41:
+			k = {{Int16SSE<false>, Int16SSE<true>},
+			     {Int32SSE<false>, Int32SSE<true>},
+			     {Float32SSE<false>, Float32SSE<true>}};
+			break;
+		case ISA::Scalar: break;
+	}
+#endif
+	return k;
+}
+
+const KernelSet &Kernels() {
+	static const KernelSet k = SelectKernels();
+	return k;
+}
+
+} // End anonymous namespace
+
+void DecodeInt16(const char *src, float *dst, const size_t n, const float mult, const bool swap) {
+	Kernels().int16[swap](src, dst, n, mult);
+}
+
+void DecodeInt32(const char *src, float *dst, const size_t n, const float mult, const bool swap) {
+	Kernels().int32[swap](src, dst, n, mult);
+}
+
+void DecodeFloat32(const char *src, float *dst, const size_t n, const float mult, const bool swap) {
+	Kernels().float32[swap](src, dst, n, mult);
+}
+
+const char *DecodeKernelName() {
+	switch (HostISA()) {
+		case ISA::AVX2:  return "AVX2";
+		case ISA::SSE41: return "SSE4.1";
+		case ISA::Scalar: return "Scalar";
+	}
+	return "Scalar";
+}
+
+} // End namespace Agilent
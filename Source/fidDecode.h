@@ -0,0 +1,29 @@
+/*
+ *  fidDecode.h
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#ifndef AGILENT_FIDDECODE
+#define AGILENT_FIDDECODE
+
+#include <cstddef>
+
+namespace Agilent {
+
+/*
+ *  Sample decode kernels. Each one converts n raw samples (optionally byte-swapped)
+ *  to float and multiplies by mult in a single pass. The AVX2 or SSE4.1 version is
+ *  chosen at runtime if the CPU supports it, otherwise a scalar loop is used.
+ *  src does not need to be aligned.
+ */
+void DecodeInt16(const char *src, float *dst, const size_t n, const float mult, const bool swap);
+void DecodeInt32(const char *src, float *dst, const size_t n, const float mult, const bool swap);
+void DecodeFloat32(const char *src, float *dst, const size_t n, const float mult, const bool swap);
+
+const char *DecodeKernelName(); //!< Name of the instruction set the kernels were dispatched to
+
+} // End namespace Agilent
+
+#endif // AGILENT_FIDDECODE
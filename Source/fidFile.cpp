@@ -6,6 +6,17 @@
  */
 
 #include "fidFile.h"
+#include "fidDecode.h"
+
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 namespace Agilent {
 
@@ -33,41 +44,180 @@ void FIDFile::SwapBlockHeader(BlockHeader *hdr) {
 	SwapEndianness(&hdr->tlt);
 }
 
+void FIDFile::SwapHyperComplexHeader(HyperComplexHeader *hdr) {
+	SwapEndianness(&hdr->s_spare1);
+	SwapEndianness(&hdr->status);
+	SwapEndianness(&hdr->s_spare2);
+	SwapEndianness(&hdr->s_spare3);
+	SwapEndianness(&hdr->l_spare1);
+	SwapEndianness(&hdr->lpval1);
+	SwapEndianness(&hdr->rpval1);
+	SwapEndianness(&hdr->f_spare1);
+	SwapEndianness(&hdr->f_spare2);
+}
+
 FIDFile::FIDFile() :
-    m_numBlocks(0), m_numTraces(0), m_numPoints(0),
+    m_fd(-1), m_map(nullptr), m_mapSize(0), m_fileSize(0), m_wantMap(true),
+    m_numBlocks(0), m_numTraces(0), m_numPoints(0), m_numBlockHeaders(0),
     m_bytesPerPoint(0), m_bytesPerTrace(0), m_bytesPerBlock(0),
-    m_status(0), m_version_id(0), m_numBlockHeaders(0)
+    m_status(0), m_version_id(0)
 {
 
 }
 
-FIDFile::FIDFile(const string& path) {
-	open(path);
+FIDFile::FIDFile(const string& path, const bool map) : FIDFile() {
+	open(path, map);
+}
+
+void FIDFile::open(const string& inPath, const bool map) {
+    close();
+    const string path = CompressedFile::Find(inPath);
+    if (CompressedFile::IsCompressed(path)) {
+        m_zip = CompressedFile::Open(path);
+        // The uncompressed size is not known until the end, so trust the header
+        m_fileSize = sizeof(FileHeader);
+        readFileHeader();
+        m_fileSize += static_cast<size_t>(max(m_numBlocks, 0)) * max(m_bytesPerBlock, 0);
+        m_index.clear();
+        indexBlocks();
+        return;
+    }
+    m_fd = ::open(path.c_str(), O_RDONLY);
+    if (m_fd < 0)
+        throw(runtime_error("Could not open fid file: " + path));
+    m_wantMap = map;
+    struct stat info;
+    if (fstat(m_fd, &info) != 0)
+        throw(runtime_error("Could not stat fid file: " + path));
+    m_fileSize = info.st_size;
+    mapFile();
+    readFileHeader();
+    m_index.clear();
+    indexBlocks();
 }
 
-void FIDFile::open(const string& path) {
+void FIDFile::mapFile() {
+    if (m_map) {
+        munmap(const_cast<char *>(m_map), m_mapSize);
+        m_map = nullptr;
+        m_mapSize = 0;
+    }
+    if (m_wantMap && (m_fileSize > 0)) {
+        void *addr = mmap(nullptr, m_fileSize, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (addr != MAP_FAILED) {
+            m_map = static_cast<const char *>(addr);
+            m_mapSize = m_fileSize;
+            // Blocks are nearly always read front to back
+            madvise(addr, m_mapSize, MADV_SEQUENTIAL);
+        }
+    }
+}
+
+void FIDFile::readFileHeader() {
 	FileHeader hdr;
-    m_file.open(path, ios::in | ios::binary);
-    if (m_file.read(reinterpret_cast<char *>(&hdr), sizeof(hdr))) {
-		// FID files are BIG endian, so swap if the host is little endian
-        m_swap = HostEndianness() == LittleEndian;
-        if (m_swap)
-			SwapFileHeader(&hdr);
-		
-        m_numBlocks = hdr.nblocks;
-        m_numTraces = hdr.ntraces;
-        m_numPoints = hdr.np;
-        m_bytesPerPoint = hdr.ebytes;
-        m_bytesPerTrace = hdr.tbytes;
-        m_bytesPerBlock = hdr.bbytes;
-        m_status = bitset<16>(hdr.status);
-        m_version_id = bitset<16>(hdr.vers_id);
-        m_numBlockHeaders = hdr.nbheaders;
-	}
+    readBytes(0, sizeof(hdr), reinterpret_cast<char *>(&hdr));
+    // FID files are BIG endian, so swap if the host is little endian
+    m_swap = HostEndianness() == LittleEndian;
+    if (m_swap)
+        SwapFileHeader(&hdr);
+
+    m_numBlocks = hdr.nblocks;
+    m_numTraces = hdr.ntraces;
+    m_numPoints = hdr.np;
+    m_bytesPerPoint = hdr.ebytes;
+    m_bytesPerTrace = hdr.tbytes;
+    m_bytesPerBlock = hdr.bbytes;
+    m_status = bitset<16>(hdr.status);
+    m_version_id = bitset<16>(hdr.vers_id);
+    m_numBlockHeaders = hdr.nbheaders;
+}
+
+bool FIDFile::refresh() {
+    if (m_zip)
+        return false; // Nothing is acquiring into a compressed file
+    const int before = nCompleteBlocks();
+    struct stat info;
+    if (fstat(m_fd, &info) != 0)
+        throw(runtime_error("Could not stat fid file while following it"));
+    if (static_cast<size_t>(info.st_size) != m_fileSize) {
+        m_fileSize = info.st_size;
+        mapFile();
+    }
+    // The acquisition may update the block count in the header as it goes. Nothing
+    // else in the header changes, so leave the rest alone for any thread decoding
+    FileHeader hdr;
+    readBytes(0, sizeof(hdr), reinterpret_cast<char *>(&hdr));
+    if (m_swap)
+        SwapEndianness(&hdr.nblocks);
+    m_numBlocks = hdr.nblocks;
+    indexBlocks();
+    return nCompleteBlocks() > before;
+}
+
+int FIDFile::nCompleteBlocks() const {
+    if ((m_bytesPerBlock <= 0) || (m_fileSize < sizeof(FileHeader)))
+        return 0;
+    const size_t onDisk = (m_fileSize - sizeof(FileHeader)) / m_bytesPerBlock;
+    return static_cast<int>(min(onDisk, static_cast<size_t>(m_numBlocks)));
+}
+
+bool FIDFile::waitForBlock(int block, const double timeout, const double poll) {
+    // A large block can take longer than timeout to arrive, so only give up if nothing does
+    auto grew = chrono::steady_clock::now();
+    while (block >= nCompleteBlocks()) {
+        if (chrono::duration<double>(chrono::steady_clock::now() - grew).count() > timeout)
+            return false;
+        this_thread::sleep_for(chrono::duration<double>(poll));
+        const size_t before = m_fileSize;
+        refresh();
+        if (m_fileSize != before)
+            grew = chrono::steady_clock::now();
+    }
+    return true;
+}
+
+void FIDFile::close() {
+    if (m_map) {
+        munmap(const_cast<char *>(m_map), m_mapSize);
+        m_map = nullptr;
+        m_mapSize = 0;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_zip.reset();
+    m_indexed.clear();
+    m_fileSize = 0;
 }
 
 FIDFile::~FIDFile() {
-    m_file.close();
+    close();
+}
+
+bool FIDFile::isMapped() const { return m_map != nullptr; }
+size_t FIDFile::fileSize() const { return m_fileSize; }
+
+void FIDFile::readBytes(const size_t offset, const size_t n, char *dst) const {
+    if (m_zip) {
+        m_zip->read(offset, n, dst);
+        return;
+    }
+    if (m_map) {
+        if (offset + n > m_mapSize)
+            throw(runtime_error("Tried to read past the end of the fid file."));
+        memcpy(dst, m_map + offset, n);
+        return;
+    }
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = pread(m_fd, dst + done, n - done, offset + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            throw(runtime_error("Error while reading fid file at offset " + to_string(offset + done)));
+        done += r;
+    }
 }
 
 const int FIDFile::nBlocks() const { return m_numBlocks; }
@@ -85,53 +235,282 @@ FIDFile::FIDType FIDFile::dataType() const {
 		return Int16Type;
 }
 
-std::vector<complex<float>> FIDFile::readBlock(int index) {
-    m_file.seekg(sizeof(FileHeader) + index * m_bytesPerBlock);
-	BlockHeader hdr;
-	double scale;
-    if (m_file.read(reinterpret_cast<char *>(&hdr), sizeof(hdr))) {
+size_t FIDFile::blockOffset(int index) const {
+    return sizeof(FileHeader) + static_cast<size_t>(index) * m_bytesPerBlock;
+}
+
+size_t FIDFile::dataOffset(int index) const {
+    // _bytesPerBlock includes all of the 28 byte block headers
+    return blockOffset(index) + m_numBlockHeaders * sizeof(BlockHeader);
+}
+
+auto FIDFile::readBlockInfo(int index) const -> BlockInfo {
+    static_assert(sizeof(BlockHeader) == sizeof(HyperComplexHeader), "Block headers must all be 28 bytes");
+    BlockInfo info{1, 0, 0, 0, 1, 0, 0, 0, 0};
+    if (m_numBlockHeaders < 1) {
+        // No header, so no scale and assume the block holds data
+        return info;
+    }
+    BlockHeader hdr;
+    readBytes(blockOffset(index), sizeof(BlockHeader), reinterpret_cast<char *>(&hdr));
+    if (m_swap)
+        SwapBlockHeader(&hdr);
+    // No scaling is signified by a zero :-(
+    info.scale = (hdr.scale == 0) ? 1.f : hdr.scale;
+    info.status = hdr.status;
+    info.index = hdr.index;
+    info.mode = hdr.mode;
+    info.ctcount = hdr.ctcount;
+    info.lpval = hdr.lpval;
+    info.rpval = hdr.rpval;
+    if (m_numBlockHeaders > 1) {
+        HyperComplexHeader hc;
+        readBytes(blockOffset(index) + sizeof(BlockHeader), sizeof(HyperComplexHeader), reinterpret_cast<char *>(&hc));
         if (m_swap)
-			SwapBlockHeader(&hdr);
-		scale = hdr.scale;
-		// No scaling is signified by a zero :-(
-		if (scale == 0)
-			scale = 1;
-	}
-    std::vector<complex<float>> block (nComplexPerBlock());
-	// _bytesPerBlock includes the 28 byte block header
-    int numBytes = m_bytesPerTrace * m_numTraces;
-	char *bytes = new char[numBytes];
-    if (m_file.read(bytes, numBytes)) {
-		switch (dataType()) {
-			case Float32Type: {
-				float *ptr = reinterpret_cast<float *>(bytes);
-                if (m_swap) SwapEndianness(ptr, nPointsPerBlock());
-				for (int i = 0; i < nComplexPerBlock(); i++) {
-					block[i].real(ptr[i*2] / scale);
-					block[i].imag(ptr[i*2+1] / scale);
-				}
-			} break;
-			case Int32Type: {
-				int32_t *ptr = reinterpret_cast<int32_t *>(bytes);
-                if (m_swap) SwapEndianness(ptr, nPointsPerBlock());
-				for (int i = 0; i < nComplexPerBlock(); i++) {
-					block[i].real(ptr[i*2] / scale);
-					block[i].imag(ptr[i*2+1] / scale);
-				}
-			} break;
-			case Int16Type: {
-				int16_t *ptr = reinterpret_cast<int16_t *>(bytes);
-                if (m_swap) SwapEndianness(ptr, nPointsPerBlock());
-				for (int i = 0; i < nComplexPerBlock(); i++) {
-					block[i].real(ptr[i*2] / scale);
-					block[i].imag(ptr[i*2+1] / scale);
-				}
-			} break;
-		}
-	}
+            SwapHyperComplexHeader(&hc);
+        info.lpval1 = hc.lpval1;
+        info.rpval1 = hc.rpval1;
+    }
+    return info;
+}
+
+void FIDFile::indexBlocks() {
+    const int n = nCompleteBlocks();
+    if (m_zip) {
+        // Reading every header now would mean decompressing the whole file, so each
+        // one is read by blockInfo() on first use, just before its samples
+        m_index.resize(n);
+        m_indexed.assign(n, false);
+        return;
+    }
+    m_index.reserve(n);
+    for (int b = m_index.size(); b < n; b++) {
+        m_index.push_back(readBlockInfo(b));
+    }
+}
+
+auto FIDFile::blockInfo(int block) const -> const BlockInfo & {
+    if ((block < 0) || (block >= static_cast<int>(m_index.size()))) {
+        throw(out_of_range("Block " + to_string(block) + " is not in the fid file, which has " +
+                           to_string(m_index.size()) + " complete blocks"));
+    }
+    if (m_zip) {
+        lock_guard<mutex> lock(m_indexMutex);
+        if (!m_indexed[block]) {
+            m_index[block] = readBlockInfo(block);
+            m_indexed[block] = true;
+        }
+    }
+    return m_index[block];
+}
+
+bool FIDFile::blockHasData(int block) const {
+    return blockInfo(block).ctcount > 0;
+}
+
+const char *FIDFile::rawBytes(const size_t offset, const size_t n, vector<char> &scratch) const {
+    if (m_map) {
+        if (offset + n > m_mapSize)
+            throw(runtime_error("Tried to read past the end of the fid file."));
+        return m_map + offset;
+    } else {
+        scratch.resize(n);
+        readBytes(offset, n, scratch.data());
+        return scratch.data();
+    }
+}
+
+auto FIDFile::blockView(int index) -> BlockView {
+    return blockView(index, m_scratch);
+}
+
+auto FIDFile::blockView(int index, vector<char> &scratch) const -> BlockView {
+    BlockView view;
+    view.info = blockInfo(index);
+    view.nbytes = static_cast<size_t>(m_bytesPerTrace) * m_numTraces;
+    view.traceBytes = m_bytesPerTrace;
+    view.data = rawBytes(dataOffset(index), view.nbytes, scratch);
+    return view;
+}
+
+void FIDFile::decode(const char *bytes, const size_t n, const float scale, complex<float> *out) const {
+    // complex<float> is guaranteed to be laid out as float[2], so decode straight into it
+    float *dst = reinterpret_cast<float *>(out);
+    const float mult = 1.f / scale;
+    switch (dataType()) {
+        case Float32Type: DecodeFloat32(bytes, dst, n, mult, m_swap); break;
+        case Int32Type:   DecodeInt32(bytes, dst, n, mult, m_swap); break;
+        case Int16Type:   DecodeInt16(bytes, dst, n, mult, m_swap); break;
+    }
+}
+
+std::vector<complex<float>> FIDFile::readBlock(int index) {
+    std::vector<complex<float>> block(nComplexPerBlock());
+    readBlock(index, block.data());
 	return block;
 }
 
+void FIDFile::readBlock(int index, complex<float> *out) {
+    readBlock(index, out, m_scratch);
+}
+
+void FIDFile::readBlock(int index, complex<float> *out, vector<char> &scratch) const {
+    if (!blockHasData(index)) {
+        // Nothing was acquired, so don't touch the payload
+        fill(out, out + nComplexPerBlock(), complex<float>(0, 0));
+        return;
+    }
+    BlockView view = blockView(index, scratch);
+    decode(view.data, nPointsPerBlock(), view.info.scale, out);
+}
+
+template<typename T>
+float FIDFile::readNative(int index, const int type, complex<T> *out, vector<char> &scratch) const {
+    if (dataType() != type)
+        throw(runtime_error("Native block type does not match the fid sample type."));
+    if (!blockHasData(index)) {
+        fill(out, out + nComplexPerBlock(), complex<T>(0, 0));
+        return 1.f;
+    }
+    BlockView view = blockView(index, scratch);
+    // complex<T> is laid out as T[2], so the samples can be copied as they are
+    T *dst = reinterpret_cast<T *>(out);
+    memcpy(dst, view.data, view.nbytes);
+    if (m_swap)
+        SwapEndianness(dst, nPointsPerBlock());
+    return 1.f / view.info.scale;
+}
+
+float FIDFile::readNativeBlock(int index, complex<int16_t> *out) {
+    return readNative(index, Int16Type, out, m_scratch);
+}
+
+float FIDFile::readNativeBlock(int index, complex<int16_t> *out, vector<char> &scratch) const {
+    return readNative(index, Int16Type, out, scratch);
+}
+
+float FIDFile::readNativeBlock(int index, complex<int32_t> *out) {
+    return readNative(index, Int32Type, out, m_scratch);
+}
+
+float FIDFile::readNativeBlock(int index, complex<int32_t> *out, vector<char> &scratch) const {
+    return readNative(index, Int32Type, out, scratch);
+}
+
+void FIDFile::checkTable(const vector<size_t> &table) const {
+    if (table.size() != static_cast<size_t>(nTraces()))
+        throw(runtime_error("Scatter table has " + to_string(table.size()) + " entries but blocks have " + to_string(nTraces()) + " traces."));
+}
+
+auto FIDFile::scatterView(int index, vector<char> &scratch) const -> BlockView {
+    if (!blockHasData(index))
+        return BlockView{blockInfo(index), nullptr, 0, static_cast<size_t>(m_bytesPerTrace)};
+    return blockView(index, scratch);
+}
+
+void FIDFile::scatterBlock(const BlockView &view, const vector<size_t> &table, complex<float> *dest) const {
+    checkTable(table);
+    if (view.info.ctcount <= 0) {
+        for (int t = 0; t < nTraces(); t++) {
+            if (table[t] != SkipTrace)
+                fill(dest + table[t], dest + table[t] + nComplexPerTrace(), complex<float>(0, 0));
+        }
+        return;
+    }
+    for (int t = 0; t < nTraces(); t++) {
+        if (table[t] != SkipTrace)
+            decode(view.trace(t), nPointsPerTrace(), view.info.scale, dest + table[t]);
+    }
+}
+
+void FIDFile::scatterBlock(int index, const vector<size_t> &table, complex<float> *dest, vector<char> &scratch) const {
+    scatterBlock(scatterView(index, scratch), table, dest);
+}
+
+template<typename T>
+float FIDFile::scatterNative(const BlockView &view, const int type, const vector<size_t> &table, complex<T> *dest) const {
+    if (dataType() != type)
+        throw(runtime_error("Native block type does not match the fid sample type."));
+    checkTable(table);
+    if (view.info.ctcount <= 0) {
+        for (int t = 0; t < nTraces(); t++) {
+            if (table[t] != SkipTrace) {
+                T *dst = reinterpret_cast<T *>(dest + table[t]);
+                fill(dst, dst + nPointsPerTrace(), 0);
+            }
+        }
+        return 1.f;
+    }
+    for (int t = 0; t < nTraces(); t++) {
+        if (table[t] == SkipTrace)
+            continue;
+        T *dst = reinterpret_cast<T *>(dest + table[t]);
+        memcpy(dst, view.trace(t), view.traceBytes);
+        if (m_swap)
+            SwapEndianness(dst, nPointsPerTrace());
+    }
+    return 1.f / view.info.scale;
+}
+
+float FIDFile::scatterNativeBlock(const BlockView &view, const vector<size_t> &table, complex<int16_t> *dest) const {
+    return scatterNative(view, Int16Type, table, dest);
+}
+
+float FIDFile::scatterNativeBlock(const BlockView &view, const vector<size_t> &table, complex<int32_t> *dest) const {
+    return scatterNative(view, Int32Type, table, dest);
+}
+
+float FIDFile::scatterNativeBlock(int index, const vector<size_t> &table, complex<int16_t> *dest, vector<char> &scratch) const {
+    return scatterNative(scatterView(index, scratch), Int16Type, table, dest);
+}
+
+float FIDFile::scatterNativeBlock(int index, const vector<size_t> &table, complex<int32_t> *dest, vector<char> &scratch) const {
+    return scatterNative(scatterView(index, scratch), Int32Type, table, dest);
+}
+
+void FIDFile::adviseBlocks(int first, int count) const {
+    if (m_zip)
+        return;
+    const int last = min(first + count, nCompleteBlocks());
+    if ((first < 0) || (first >= last))
+        return;
+    const size_t start = blockOffset(first);
+    const size_t length = blockOffset(last) - start;
+    if (m_map) {
+        // madvise needs a page-aligned address
+        const size_t aligned = start & ~(static_cast<size_t>(sysconf(_SC_PAGESIZE)) - 1);
+        madvise(const_cast<char *>(m_map) + aligned, length + (start - aligned), MADV_WILLNEED);
+    } else {
+        posix_fadvise(m_fd, start, length, POSIX_FADV_WILLNEED);
+    }
+}
+
+std::vector<complex<float>> FIDFile::readTraces(int block, int first, int count) {
+    std::vector<complex<float>> traces(static_cast<size_t>(count) * nComplexPerTrace());
+    readTraces(block, first, count, traces.data());
+    return traces;
+}
+
+void FIDFile::readTraces(int block, int first, int count, complex<float> *out) {
+    readTraces(block, first, count, out, m_scratch);
+}
+
+void FIDFile::readTraces(int block, int first, int count, complex<float> *out, vector<char> &scratch) const {
+    if ((first < 0) || (count < 0) || (first + count > m_numTraces)) {
+        throw(out_of_range("Invalid trace range " + to_string(first) + "+" + to_string(count) +
+                           " for block with " + to_string(m_numTraces) + " traces"));
+    }
+    // Only the requested traces are touched
+    if (!blockHasData(block)) {
+        fill(out, out + static_cast<size_t>(count) * nComplexPerTrace(), complex<float>(0, 0));
+        return;
+    }
+    const float scale = blockInfo(block).scale;
+    const size_t offset = dataOffset(block) + static_cast<size_t>(first) * m_bytesPerTrace;
+    const char *bytes = rawBytes(offset, static_cast<size_t>(count) * m_bytesPerTrace, scratch);
+    decode(bytes, static_cast<size_t>(count) * nPointsPerTrace(), scale, out);
+}
+
 const string FIDFile::print_header() const {
 	stringstream ss;
 	
@@ -142,7 +521,14 @@ const string FIDFile::print_header() const {
        << "Number of bytes per trace: " << m_bytesPerTrace << endl
        << "Number of bytes per block: " << m_bytesPerBlock << endl
        << "Status bits: " << m_status << " Version/ID bits: " << m_version_id << endl
-       << "Number of block headers per block: " << m_numBlockHeaders;
+       << "Number of block headers per block: " << m_numBlockHeaders << endl;
+    if (m_zip) {
+        ss << "Compression: " << m_zip->format() << endl
+           << "Blocks: " << m_index.size();
+    } else {
+        ss << "Complete blocks: " << m_index.size() << " Empty blocks: "
+           << count_if(m_index.begin(), m_index.end(), [](const BlockInfo &b) { return b.ctcount == 0; });
+    }
 	return ss.str();
 }
 
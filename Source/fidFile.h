@@ -13,9 +13,15 @@
 #include <fstream>
 #include <bitset>
 #include <complex>
+#include <cstdint>
 #include <vector>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <mutex>
 
 #include "util.h"
+#include "fidStream.h"
 
 using namespace std;
 
@@ -112,7 +118,7 @@ namespace Agilent {
 
 class FIDFile {
 
-	private:
+	public:
 		//! Used at the beginning of each data file (fid's, spectra, 2D)
 		typedef struct datafilehead {
 		   int     nblocks;      //!< Number of blocks in file
@@ -152,16 +158,64 @@ class FIDFile {
 		   float   f_spare1; //!< float word:  spare
 		   float   f_spare2; //!< float word:  spare
 		} HyperComplexHeader;
-		
+
+		//! The parts of a block's header(s) kept in the index built by open()
+		struct BlockInfo {
+			float scale;          //!< Divisor for the samples, 1 if the header said 0
+			short status, index, mode;
+			int   ctcount;        //!< Number of transients, 0 for an empty or aborted block
+			float lpval, rpval;   //!< F2 phases
+			float lpval1, rpval1; //!< Additional phases from a hypercomplex header, otherwise 0
+		};
+
+		/*!
+		 *  A lightweight view of one block. The header comes from the block index,
+		 *  the payload is left exactly as it is on disk (big endian).
+		 *  For a mapped file the payload points into the mapping and stays valid
+		 *  until the FIDFile is closed, otherwise it points into an internal
+		 *  buffer that is overwritten by the next call to blockView().
+		 */
+		struct BlockView {
+			BlockInfo   info;
+			const char *data;      //!< Raw payload, excluding the block header(s)
+			size_t      nbytes;    //!< Size of the payload in bytes
+			size_t      traceBytes;
+
+			const char *trace(const int t) const { return data + t * traceBytes; }
+		};
+
+	private:
 		static void SwapFileHeader(FileHeader *hdr);
 		static void SwapBlockHeader(BlockHeader *hdr);
+		static void SwapHyperComplexHeader(HyperComplexHeader *hdr);
 		
 		//! Actual member variables
-        ifstream m_file;
+        int m_fd;
+        const char *m_map;
+        size_t m_mapSize, m_fileSize;
+        bool m_wantMap;
+        vector<char> m_scratch;
+        mutable vector<BlockInfo> m_index;
+        unique_ptr<CompressedFile> m_zip;  //!< Set when reading a fid.gz or fid.zst
+        mutable vector<bool> m_indexed;    //!< For compressed fids, which block headers have been read
+        mutable mutex m_indexMutex;
         int m_numBlocks, m_numTraces, m_numPoints, m_numBlockHeaders,
             m_bytesPerPoint, m_bytesPerTrace, m_bytesPerBlock;
         bitset<16> m_status, m_version_id;
         bool m_swap;
+
+        void mapFile();
+        void readFileHeader();
+        size_t blockOffset(int block) const; //!< Offset of the start of a block's header(s)
+        size_t dataOffset(int block) const;  //!< Offset of the start of a block's samples
+        BlockInfo readBlockInfo(int block) const;
+        void indexBlocks(); //!< Add any newly complete blocks to the index
+        void readBytes(const size_t offset, const size_t n, char *dst) const;
+        const char *rawBytes(const size_t offset, const size_t n, vector<char> &scratch) const;
+        void decode(const char *bytes, const size_t n, const float scale, complex<float> *out) const;
+        template<typename T> float readNative(int block, const int type, complex<T> *out, vector<char> &scratch) const;
+        template<typename T> float scatterNative(const BlockView &view, const int type, const vector<size_t> &table, complex<T> *dest) const;
+        void checkTable(const vector<size_t> &table) const;
 		
 	public:
 		enum FIDType {
@@ -171,10 +225,30 @@ class FIDFile {
 		};
 		
 		FIDFile();
-		FIDFile(const string &path);
+		FIDFile(const string &path, const bool map = true);
 		~FIDFile();
+		FIDFile(const FIDFile &) = delete;
+		FIDFile &operator=(const FIDFile &) = delete;
 		
-		void open(const string &path);
+		/*!
+		 *  Map the file into memory if possible, otherwise fall back to pread. If path
+		 *  does not exist but path.gz or path.zst does, or path ends in one of those,
+		 *  it is decompressed as it is read. Compressed fids cannot be followed.
+		 */
+		void open(const string &path, const bool map = true);
+		void close();
+		bool isMapped() const;
+		size_t fileSize() const; //!< In bytes as of the last refresh(), for a compressed fid the size the header implies
+
+		/*!
+		 *  For a fid that is still being acquired: re-read the file size and header,
+		 *  remapping if the file has grown. Invalidates any outstanding BlockViews
+		 *  into the mapping. Only the block count is taken from the header again.
+		 *  Returns true if more complete blocks are now available.
+		 */
+		bool refresh();
+		int nCompleteBlocks() const; //!< The number of blocks that are entirely on disk
+		bool waitForBlock(int block, const double timeout, const double poll = 0.25); //!< Poll with refresh() until block is on disk, or false if the file has not grown for timeout (s)
 		
 		bool hasData();
 		bool isFID();
@@ -185,8 +259,49 @@ class FIDFile {
 		const int nComplexPerTrace() const; //!< The number of complex points per trace (nPoints / 2)
 		const int nComplexPerBlock() const; //!< The number of complex points per block (nPoints / 2)
 		FIDType dataType() const; //!< The sample data type
+
+		const BlockInfo &blockInfo(int block) const; //!< Header fields of a complete block, from the index
+		bool blockHasData(int block) const;          //!< False for blocks with a ctcount of 0
 		
+        BlockView blockView(int block); //!< Header and raw payload of a block, no copy if mapped
+        BlockView blockView(int block, vector<char> &scratch) const; //!< As above, but unmapped reads go to scratch
         std::vector<complex<float> > readBlock(int block);
+        void readBlock(int block, complex<float> *out); //!< Decode into caller storage, which must hold nComplexPerBlock() values
+        void readBlock(int block, complex<float> *out, vector<char> &scratch) const; //!< Safe to call from several threads with separate scratch
+        /*!
+         *  Copy a block of integer samples without converting them to float, so it
+         *  takes a half or a quarter of the memory. The samples are byte-swapped but
+         *  not scaled; multiply by the returned factor to get the values readBlock()
+         *  would give. Throws if the fid does not hold that sample type.
+         */
+        float readNativeBlock(int block, complex<int16_t> *out);
+        float readNativeBlock(int block, complex<int16_t> *out, vector<char> &scratch) const;
+        float readNativeBlock(int block, complex<int32_t> *out);
+        float readNativeBlock(int block, complex<int32_t> *out, vector<char> &scratch) const;
+        /*!
+         *  Decode each trace t of a block straight into dest + table[t], e.g. its line
+         *  of the final k-space array, skipping traces whose entry is SkipTrace. The
+         *  table must have nTraces() entries, each with nComplexPerTrace() values of
+         *  room after it. Safe to call from several threads with separate scratch.
+         */
+        static const size_t SkipTrace = static_cast<size_t>(-1);
+        void scatterBlock(int block, const vector<size_t> &table, complex<float> *dest, vector<char> &scratch) const;
+        float scatterNativeBlock(int block, const vector<size_t> &table, complex<int16_t> *dest, vector<char> &scratch) const; //!< As readNativeBlock(), returns the scale factor
+        float scatterNativeBlock(int block, const vector<size_t> &table, complex<int32_t> *dest, vector<char> &scratch) const;
+        /*!
+         *  The same from a view that scatterView() or a BlockPrefetcher made, so
+         *  the read can happen somewhere else. scatterView() is blockView(), except
+         *  that a block without data is not read and gets a null payload, which
+         *  these fill with zeros.
+         */
+        BlockView scatterView(int block, vector<char> &scratch) const;
+        void scatterBlock(const BlockView &view, const vector<size_t> &table, complex<float> *dest) const;
+        float scatterNativeBlock(const BlockView &view, const vector<size_t> &table, complex<int16_t> *dest) const;
+        float scatterNativeBlock(const BlockView &view, const vector<size_t> &table, complex<int32_t> *dest) const;
+        void adviseBlocks(int first, int count) const; //!< Ask the kernel to start reading these blocks in the background
+        std::vector<complex<float> > readTraces(int block, int first, int count); //!< Read only traces [first, first + count) of a block
+        void readTraces(int block, int first, int count, complex<float> *out);
+        void readTraces(int block, int first, int count, complex<float> *out, vector<char> &scratch) const;
 		
 		const string print_header() const;
 };
@@ -0,0 +1,126 @@
+/*
+ *  fidPrefetch.cpp
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#include "fidPrefetch.h"
+
+#include <chrono>
+
+namespace Agilent {
+
+BlockPrefetcher::BlockPrefetcher(FIDFile &file, const std::vector<int> &order, const size_t depth, const double follow) :
+	m_file(file), m_order(order),
+	m_produced(0), m_consumed(0), m_follow(follow), m_holding(false), m_stop(false)
+{
+	if (depth < 1)
+		throw(invalid_argument("Prefetch depth must be at least 1"));
+	for (auto b : m_order) {
+		// A growing file may not have written all its blocks to the header yet
+		if ((b < 0) || ((m_follow < 0) && (b >= m_file.nBlocks())))
+			throw(out_of_range("Invalid block number " + std::to_string(b) + " for prefetch"));
+	}
+	m_ring.resize(depth);
+	m_views.resize(depth);
+	m_thread = std::thread(&BlockPrefetcher::run, this);
+}
+
+BlockPrefetcher::BlockPrefetcher(FIDFile &file, const int first, const int count, const size_t depth, const double follow) :
+	BlockPrefetcher(file, [=]() { std::vector<int> o(count); for (int i = 0; i < count; i++) o[i] = first + i; return o; }(), depth, follow)
+{}
+
+BlockPrefetcher::~BlockPrefetcher() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_space.notify_all();
+	m_thread.join();
+}
+
+void BlockPrefetcher::run() {
+	for (size_t i = 0; i < m_order.size(); i++) {
+		{
+			// The slot being read by the consumer is still in use until it asks for the next one
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_space.wait(lock, [&]{ return m_stop || (m_produced - m_consumed + (m_holding ? 1 : 0) < m_ring.size()); });
+			if (m_stop)
+				return;
+		}
+		try {
+			if ((m_follow >= 0) && !waitFor(m_order[i]))
+				return;
+			// Have the kernel start on the next block while this one is read
+			if (i + 1 < m_order.size())
+				m_file.adviseBlocks(m_order[i + 1], 1);
+			const size_t slot = i % m_ring.size();
+			std::vector<char> &buffer = m_ring[slot];
+			FIDFile::BlockView view = m_file.scatterView(m_order[i], buffer);
+			if (view.data && (view.data != buffer.data())) {
+				// Mapped, so copy it here, where the page faults do not hold up the
+				// consumer, and where a refresh() that remaps cannot pull it away
+				buffer.assign(view.data, view.data + view.nbytes);
+				view.data = buffer.data();
+			}
+			m_views[slot] = view;
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_error = std::current_exception();
+			m_ready.notify_all();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_produced++;
+		}
+		m_ready.notify_all();
+	}
+}
+
+bool BlockPrefetcher::waitFor(const int block) {
+	const double poll = 0.25;
+	double waited = 0;
+	while (block >= m_file.nCompleteBlocks()) {
+		{
+			// Sleep on the condition variable so the destructor can wake us
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_space.wait_for(lock, std::chrono::duration<double>(poll), [&]{ return m_stop; }))
+				return false;
+		}
+		waited += poll;
+		const size_t before = m_file.fileSize();
+		m_file.refresh();
+		if (m_file.fileSize() != before)
+			waited = 0;
+		else if (waited > m_follow)
+			throw(runtime_error("Gave up waiting for block " + std::to_string(block)));
+	}
+	return true;
+}
+
+size_t BlockPrefetcher::remaining() const {
+	return m_order.size() - m_consumed;
+}
+
+const FIDFile::BlockView &BlockPrefetcher::next(int *block) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_holding) {
+		m_holding = false;
+		m_space.notify_all();
+	}
+	if (m_consumed == m_order.size())
+		throw(out_of_range("No blocks left to prefetch"));
+	m_ready.wait(lock, [&]{ return (m_produced > m_consumed) || m_error; });
+	if (m_produced == m_consumed)
+		std::rethrow_exception(m_error);
+	const size_t slot = m_consumed % m_ring.size();
+	if (block)
+		*block = m_order[m_consumed];
+	m_consumed++;
+	m_holding = true;
+	return m_views[slot];
+}
+
+} // End namespace Agilent
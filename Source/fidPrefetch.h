@@ -0,0 +1,71 @@
+/*
+ *  fidPrefetch.h
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#ifndef AGILENT_FIDPREFETCH
+#define AGILENT_FIDPREFETCH
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+
+#include "fidFile.h"
+
+namespace Agilent {
+
+/*
+ *  Reads blocks of a FIDFile on a background thread, keeping up to depth
+ *  blocks ready in a ring of buffers, so that I/O overlaps with whatever the
+ *  caller does with each block, e.g. FIDFile::scatterBlock(). Blocks are kept
+ *  raw, as blockView() gives them, and are copied out of the mapping if the
+ *  file is mapped, so the page faults happen on this thread too.
+ *
+ *  While a prefetcher exists it is the only thing that may read from or
+ *  refresh() the file.
+ *
+ *  If follow is not negative the file is assumed to still be growing, and the
+ *  prefetcher waits for each block to reach the disk, giving up if the file has
+ *  not grown for follow seconds.
+ */
+class BlockPrefetcher {
+	private:
+		FIDFile &m_file;
+		std::vector<int> m_order;
+		std::vector<std::vector<char>> m_ring;
+		std::vector<FIDFile::BlockView> m_views;
+		size_t m_produced, m_consumed; //!< Counts of blocks, the ring slot is count % depth
+		double m_follow;
+		bool m_holding, m_stop;
+		std::exception_ptr m_error;
+		std::mutex m_mutex;
+		std::condition_variable m_ready, m_space;
+		std::thread m_thread;
+
+		void run();
+		bool waitFor(const int block); //!< Returns false if the prefetcher is stopping
+
+	public:
+		BlockPrefetcher(FIDFile &file, const std::vector<int> &order, const size_t depth = 4, const double follow = -1);
+		BlockPrefetcher(FIDFile &file, const int first, const int count, const size_t depth = 4, const double follow = -1);
+		~BlockPrefetcher();
+		BlockPrefetcher(const BlockPrefetcher &) = delete;
+		BlockPrefetcher &operator=(const BlockPrefetcher &) = delete;
+
+		size_t remaining() const; //!< Number of blocks that next() has not yet returned
+		/*!
+		 *  Wait for the next block in order and return a view of it, which stays
+		 *  valid until the following call to next(). A block without data has a
+		 *  null payload, as from FIDFile::scatterView(). Rethrows any read error.
+		 */
+		const FIDFile::BlockView &next(int *block = nullptr);
+};
+
+} // End namespace Agilent
+
+#endif // AGILENT_FIDPREFETCH
@@ -0,0 +1,322 @@
+/*
+ *  fidStream.cpp
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#include "fidStream.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#include <zlib.h>
+#ifdef AGILENT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+namespace Agilent {
+
+namespace {
+
+bool EndsWith(const string &s, const string &end) {
+	return (s.size() >= end.size()) && (s.compare(s.size() - end.size(), end.size(), end) == 0);
+}
+
+bool Exists(const string &path) {
+	struct stat info;
+	return stat(path.c_str(), &info) == 0;
+}
+
+/*
+ *  gzip, using the approach of zlib's zran example: at the end of a deflate block
+ *  the decompressor state is just the bit offset into the input and the last 32K
+ *  of output, so that is all a seek point needs to save.
+ */
+class GzipFile : public CompressedFile {
+	private:
+		static const size_t Window = 32768;   //!< Deflate's maximum back-reference distance
+		static const size_t Chunk = 65536;    //!< Compressed bytes read at a time
+		static const size_t Span = 4 << 20;   //!< Uncompressed bytes between seek points
+
+		struct Point {
+			size_t out, in; //!< Uncompressed and compressed offsets
+			int bits;       //!< Bits of the byte before in that belong to the next block
+			vector<unsigned char> window;
+		};
+
+		string m_path;
+		FILE *m_file;
+		z_stream m_strm;
+		bool m_started, m_ended;
+		vector<unsigned char> m_in, m_window; //!< m_window holds the last 32K of output, circularly
+		size_t m_out, m_in_pos;               //!< Offsets of the next output and input bytes
+		vector<Point> m_points;
+
+		void fail(const string &msg) {
+			throw(runtime_error("Error decompressing " + m_path + ": " + msg));
+		}
+
+		void restart() {
+			// From the very beginning, so zlib handles the gzip header
+			if (m_started)
+				inflateEnd(&m_strm);
+			memset(&m_strm, 0, sizeof(m_strm));
+			if (inflateInit2(&m_strm, 15 + 32) != Z_OK)
+				fail("could not initialise zlib");
+			m_started = true;
+			m_ended = false;
+			if (fseeko(m_file, 0, SEEK_SET) != 0)
+				fail("seek failed");
+			m_out = m_in_pos = 0;
+		}
+
+		void jump(const Point &p) {
+			if (m_started)
+				inflateEnd(&m_strm);
+			memset(&m_strm, 0, sizeof(m_strm));
+			// Raw deflate, as there is no header in the middle of the stream
+			if (inflateInit2(&m_strm, -15) != Z_OK)
+				fail("could not initialise zlib");
+			m_started = true;
+			m_ended = false;
+			if (fseeko(m_file, p.in - (p.bits ? 1 : 0), SEEK_SET) != 0)
+				fail("seek failed");
+			if (p.bits) {
+				const int c = getc(m_file);
+				if (c == EOF)
+					fail("unexpected end of file");
+				inflatePrime(&m_strm, p.bits, c >> (8 - p.bits));
+			}
+			inflateSetDictionary(&m_strm, p.window.data(), p.window.size());
+			m_out = p.out;
+			m_in_pos = p.in;
+		}
+
+		void addPoint(const int bits) {
+			Point p;
+			p.out = m_out;
+			p.in = m_in_pos;
+			p.bits = bits;
+			// Unroll the circular window so the oldest byte is first
+			const size_t have = min(m_out, Window);
+			const size_t head = m_out % Window;
+			p.window.resize(have);
+			if (m_out >= Window) {
+				copy(m_window.begin() + head, m_window.end(), p.window.begin());
+				copy(m_window.begin(), m_window.begin() + head, p.window.begin() + (Window - head));
+			} else {
+				copy(m_window.begin(), m_window.begin() + have, p.window.begin());
+			}
+			m_points.push_back(move(p));
+		}
+
+	protected:
+		void readAt(const size_t offset, const size_t n, char *dst) override {
+			// Go back to the nearest seek point if we are past offset, or if there is one
+			// further forward than where we are now
+			auto after = upper_bound(m_points.begin(), m_points.end(), offset,
+			                         [](const size_t o, const Point &p) { return o < p.out; });
+			const Point *best = (after == m_points.begin()) ? nullptr : &*(after - 1);
+			if (!m_started || (offset < m_out) || (best && best->out > m_out)) {
+				if (best)
+					jump(*best);
+				else
+					restart();
+			}
+
+			size_t done = 0;
+			while (done < n) {
+				if (m_ended)
+					fail("tried to read past the end of the data");
+				if (m_strm.avail_in == 0) {
+					m_strm.avail_in = fread(m_in.data(), 1, Chunk, m_file);
+					m_strm.next_in = m_in.data();
+					if (m_strm.avail_in == 0)
+						fail(ferror(m_file) ? "read failed" : "unexpected end of file");
+				}
+				const size_t pos = m_out % Window;
+				m_strm.next_out = m_window.data() + pos;
+				m_strm.avail_out = Window - pos;
+				const size_t in_before = m_strm.avail_in;
+				// Z_BLOCK stops at each deflate block boundary, where a seek point can go
+				const int ret = inflate(&m_strm, Z_BLOCK);
+				if ((ret != Z_OK) && (ret != Z_STREAM_END) && (ret != Z_BUF_ERROR))
+					fail(m_strm.msg ? m_strm.msg : "corrupt data");
+				m_in_pos += in_before - m_strm.avail_in;
+				const size_t have = (Window - pos) - m_strm.avail_out;
+				// Copy out any part of the requested range that was just produced
+				const size_t lo = max(m_out, offset + done);
+				const size_t hi = min(m_out + have, offset + n);
+				if (lo < hi) {
+					memcpy(dst + (lo - offset), m_window.data() + pos + (lo - m_out), hi - lo);
+					done = hi - offset;
+				}
+				m_out += have;
+				if (ret == Z_STREAM_END) {
+					m_ended = true;
+				} else if ((m_strm.data_type & 128) && !(m_strm.data_type & 64)) {
+					if (m_points.empty() ? (m_out == 0) : (m_out > m_points.back().out + Span))
+						addPoint(m_strm.data_type & 7);
+				}
+			}
+		}
+
+	public:
+		GzipFile(const string &path) :
+			m_path(path), m_started(false), m_ended(false),
+			m_in(Chunk), m_window(Window), m_out(0), m_in_pos(0)
+		{
+			m_file = fopen(path.c_str(), "rb");
+			if (!m_file)
+				throw(runtime_error("Could not open compressed fid file: " + path));
+		}
+
+		~GzipFile() {
+			if (m_started)
+				inflateEnd(&m_strm);
+			fclose(m_file);
+		}
+
+		const char *format() const override { return "gzip"; }
+};
+// min() takes these by reference, so they need definitions
+const size_t GzipFile::Window;
+const size_t GzipFile::Chunk;
+const size_t GzipFile::Span;
+
+#ifdef AGILENT_HAVE_ZSTD
+/*
+ *  zstd can only start decompressing at the beginning of a frame, so the seek
+ *  points are frame boundaries. Files compressed as one frame can only be read
+ *  forwards, going back means starting again.
+ */
+class ZstdFile : public CompressedFile {
+	private:
+		struct Point {
+			size_t out, in;
+		};
+
+		string m_path;
+		FILE *m_file;
+		ZSTD_DStream *m_stream;
+		vector<char> m_in, m_buffer;
+		ZSTD_inBuffer m_input;
+		size_t m_out, m_in_pos;
+		vector<Point> m_points;
+
+		void fail(const string &msg) {
+			throw(runtime_error("Error decompressing " + m_path + ": " + msg));
+		}
+
+		void jump(const Point &p) {
+			ZSTD_initDStream(m_stream);
+			if (fseeko(m_file, p.in, SEEK_SET) != 0)
+				fail("seek failed");
+			m_input.src = m_in.data();
+			m_input.size = m_input.pos = 0;
+			m_out = p.out;
+			m_in_pos = p.in;
+		}
+
+	protected:
+		void readAt(const size_t offset, const size_t n, char *dst) override {
+			auto after = upper_bound(m_points.begin(), m_points.end(), offset,
+			                         [](const size_t o, const Point &p) { return o < p.out; });
+			const Point &best = *(after - 1); // There is always a point at 0
+			if ((offset < m_out) || (best.out > m_out))
+				jump(best);
+
+			size_t done = 0;
+			while (done < n) {
+				if (m_input.pos == m_input.size) {
+					m_input.size = fread(m_in.data(), 1, m_in.size(), m_file);
+					m_input.pos = 0;
+					if (m_input.size == 0)
+						fail(ferror(m_file) ? "read failed" : "tried to read past the end of the data");
+				}
+				ZSTD_outBuffer output{m_buffer.data(), m_buffer.size(), 0};
+				const size_t in_before = m_input.pos;
+				const size_t ret = ZSTD_decompressStream(m_stream, &output, &m_input);
+				if (ZSTD_isError(ret))
+					fail(ZSTD_getErrorName(ret));
+				m_in_pos += m_input.pos - in_before;
+				const size_t lo = max(m_out, offset + done);
+				const size_t hi = min(m_out + output.pos, offset + n);
+				if (lo < hi) {
+					memcpy(dst + (lo - offset), m_buffer.data() + (lo - m_out), hi - lo);
+					done = hi - offset;
+				}
+				m_out += output.pos;
+				// A return of 0 means a frame has just been completely decoded and flushed
+				if ((ret == 0) && (m_out > m_points.back().out))
+					m_points.push_back(Point{m_out, m_in_pos});
+			}
+		}
+
+	public:
+		ZstdFile(const string &path) :
+			m_path(path), m_in(ZSTD_DStreamInSize()), m_buffer(ZSTD_DStreamOutSize()),
+			m_out(0), m_in_pos(0), m_points{Point{0, 0}}
+		{
+			m_file = fopen(path.c_str(), "rb");
+			if (!m_file)
+				throw(runtime_error("Could not open compressed fid file: " + path));
+			m_stream = ZSTD_createDStream();
+			if (!m_stream) {
+				fclose(m_file);
+				throw(runtime_error("Could not create zstd stream for " + path));
+			}
+			jump(m_points.front());
+		}
+
+		~ZstdFile() {
+			ZSTD_freeDStream(m_stream);
+			fclose(m_file);
+		}
+
+		const char *format() const override { return "zstd"; }
+};
+#endif
+
+} // End anonymous namespace
+
+void CompressedFile::read(const size_t offset, const size_t n, char *dst) {
+	lock_guard<mutex> lock(m_mutex);
+	readAt(offset, n, dst);
+}
+
+bool CompressedFile::IsCompressed(const string &path) {
+	return EndsWith(path, ".gz") || EndsWith(path, ".zst");
+}
+
+string CompressedFile::Find(const string &path) {
+	if (Exists(path))
+		return path;
+	for (auto ext : {".gz", ".zst"}) {
+		if (Exists(path + ext))
+			return path + ext;
+	}
+	return path;
+}
+
+unique_ptr<CompressedFile> CompressedFile::Open(const string &path) {
+	if (EndsWith(path, ".gz")) {
+		return unique_ptr<CompressedFile>(new GzipFile(path));
+	} else if (EndsWith(path, ".zst")) {
+#ifdef AGILENT_HAVE_ZSTD
+		return unique_ptr<CompressedFile>(new ZstdFile(path));
+#else
+		throw(runtime_error("Cannot read " + path + ", Agilent Tools was built without zstd support"));
+#endif
+	}
+	throw(runtime_error("Unknown compression format: " + path));
+}
+
+} // End namespace Agilent
@@ -0,0 +1,46 @@
+/*
+ *  fidStream.h
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#ifndef AGILENT_FIDSTREAM
+#define AGILENT_FIDSTREAM
+
+#include <string>
+#include <memory>
+#include <mutex>
+
+namespace Agilent {
+
+/*
+ *  Random access to the uncompressed contents of a fid.gz or fid.zst, without
+ *  decompressing it to disk first. Reads are fastest front to back, which is how
+ *  blocks are normally read. Seek points are recorded on the way through, so that
+ *  going back only means decompressing from the nearest one, not from the start.
+ *
+ *  zstd support is only compiled in if the library was found (AGILENT_HAVE_ZSTD).
+ *  read() may be called from several threads, but calls are serialised.
+ */
+class CompressedFile {
+	private:
+		std::mutex m_mutex;
+
+	protected:
+		virtual void readAt(const size_t offset, const size_t n, char *dst) = 0;
+
+	public:
+		virtual ~CompressedFile() {}
+		virtual const char *format() const = 0; //!< Name of the compression format
+
+		void read(const size_t offset, const size_t n, char *dst); //!< Throws if there are not n bytes at offset
+
+		static bool IsCompressed(const std::string &path); //!< True if path has a compressed extension
+		static std::string Find(const std::string &path);  //!< path if it exists, else path.gz or path.zst if one does, else path
+		static std::unique_ptr<CompressedFile> Open(const std::string &path);
+};
+
+} // End namespace Agilent
+
+#endif // AGILENT_FIDSTREAM
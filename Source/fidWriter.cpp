@@ -0,0 +1,118 @@
+/*
+ *  fidWriter.cpp
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#include "fidWriter.h"
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+namespace Agilent {
+
+FIDWriter::FIDWriter(const string &path, const FIDFile::FIDType type,
+                     const int nblocks, const int ntraces, const int np, const int nbheaders) :
+	m_path(path), m_type(type),
+	m_numBlocks(nblocks), m_numTraces(ntraces), m_numPoints(np), m_numBlockHeaders(nbheaders),
+	m_written(0)
+{
+	if ((nblocks < 1) || (ntraces < 1) || (np < 2) || (np % 2) || (nbheaders < 1))
+		throw(invalid_argument("Invalid fid dimensions for " + path));
+	m_file.open(path, ios::out | ios::binary | ios::trunc);
+	if (!m_file)
+		throw(runtime_error("Could not open fid file for writing: " + path));
+
+	FIDFile::FileHeader hdr;
+	hdr.ebytes = (type == FIDFile::Int16Type) ? 2 : 4;
+	m_status = S_DATA | S_COMPLEX;
+	switch (type) {
+		case FIDFile::Float32Type: m_status |= S_32 | S_FLOAT; break;
+		case FIDFile::Int32Type:   m_status |= S_32; break;
+		case FIDFile::Int16Type:   break;
+	}
+	hdr.nblocks = nblocks;
+	hdr.ntraces = ntraces;
+	hdr.np = np;
+	hdr.tbytes = np * hdr.ebytes;
+	hdr.bbytes = hdr.tbytes * ntraces + nbheaders * sizeof(FIDFile::BlockHeader);
+	hdr.vers_id = FID_FILE;
+	hdr.status = m_status;
+	hdr.nbheaders = nbheaders;
+	m_buffer.resize(static_cast<size_t>(hdr.tbytes) * ntraces);
+	if (HostEndianness() == LittleEndian) {
+		SwapEndianness(&hdr.nblocks); SwapEndianness(&hdr.ntraces); SwapEndianness(&hdr.np);
+		SwapEndianness(&hdr.ebytes);  SwapEndianness(&hdr.tbytes);  SwapEndianness(&hdr.bbytes);
+		SwapEndianness(&hdr.vers_id); SwapEndianness(&hdr.status);  SwapEndianness(&hdr.nbheaders);
+	}
+	m_file.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+}
+
+FIDWriter::~FIDWriter() {
+	// Don't throw from the destructor, an incomplete file is left as it is
+	if (m_file.is_open())
+		m_file.close();
+}
+
+int FIDWriter::nBlocksWritten() const { return m_written; }
+
+template<typename T>
+void FIDWriter::encode(const complex<float> *data, const float scale) {
+	const size_t n = static_cast<size_t>(m_numPoints) * m_numTraces;
+	const float *in = reinterpret_cast<const float *>(data);
+	T *out = reinterpret_cast<T *>(m_buffer.data());
+	const double lo = std::is_integral<T>::value ? numeric_limits<T>::min() : -numeric_limits<float>::max();
+	const double hi = std::is_integral<T>::value ? numeric_limits<T>::max() : numeric_limits<float>::max();
+	for (size_t i = 0; i < n; i++) {
+		// Saturate rather than wrap if the data does not fit the sample type
+		const double v = min(max(static_cast<double>(in[i]) * scale, lo), hi);
+		out[i] = std::is_integral<T>::value ? static_cast<T>(llrint(v)) : static_cast<T>(v);
+	}
+	if (HostEndianness() == LittleEndian)
+		SwapEndianness(out, n);
+}
+
+void FIDWriter::writeBlock(const complex<float> *data, const short scale, const int ctcount) {
+	if (m_written >= m_numBlocks)
+		throw(runtime_error("Tried to write more than " + to_string(m_numBlocks) + " blocks to " + m_path));
+	FIDFile::BlockHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.scale = scale;
+	hdr.status = m_status;
+	hdr.index = m_written + 1;
+	hdr.ctcount = ctcount;
+	if (HostEndianness() == LittleEndian) {
+		SwapEndianness(&hdr.scale); SwapEndianness(&hdr.status);
+		SwapEndianness(&hdr.index); SwapEndianness(&hdr.ctcount);
+	}
+	m_file.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+	// Any further headers are hypercomplex ones, which are left empty
+	FIDFile::HyperComplexHeader hc;
+	memset(&hc, 0, sizeof(hc));
+	for (int h = 1; h < m_numBlockHeaders; h++)
+		m_file.write(reinterpret_cast<const char *>(&hc), sizeof(hc));
+
+	const float mult = (scale == 0) ? 1.f : scale;
+	switch (m_type) {
+		case FIDFile::Float32Type: encode<float>(data, mult); break;
+		case FIDFile::Int32Type:   encode<int32_t>(data, mult); break;
+		case FIDFile::Int16Type:   encode<int16_t>(data, mult); break;
+	}
+	m_file.write(m_buffer.data(), m_buffer.size());
+	if (!m_file)
+		throw(runtime_error("Error while writing block " + to_string(m_written) + " to " + m_path));
+	m_written++;
+}
+
+void FIDWriter::close() {
+	m_file.close();
+	if (m_written != m_numBlocks)
+		throw(runtime_error("Only " + to_string(m_written) + " of " + to_string(m_numBlocks) + " blocks were written to " + m_path));
+}
+
+} // End namespace Agilent
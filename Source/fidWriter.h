@@ -0,0 +1,53 @@
+/*
+ *  fidWriter.h
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#ifndef AGILENT_FIDWRITER
+#define AGILENT_FIDWRITER
+
+#include <string>
+#include <vector>
+#include <complex>
+#include <fstream>
+
+#include "fidFile.h"
+
+namespace Agilent {
+
+/*
+ *  Writes a fid file in the same big endian layout that FIDFile reads, one block
+ *  at a time so that files larger than memory can be produced.
+ */
+class FIDWriter {
+	private:
+		std::ofstream m_file;
+		std::string m_path;
+		FIDFile::FIDType m_type;
+		int m_numBlocks, m_numTraces, m_numPoints, m_numBlockHeaders, m_written;
+		short m_status;
+		std::vector<char> m_buffer;
+
+		template<typename T> void encode(const std::complex<float> *data, const float scale);
+
+	public:
+		FIDWriter(const std::string &path, const FIDFile::FIDType type,
+		          const int nblocks, const int ntraces, const int np, const int nbheaders = 1);
+		~FIDWriter();
+		FIDWriter(const FIDWriter &) = delete;
+		FIDWriter &operator=(const FIDWriter &) = delete;
+
+		int nBlocksWritten() const;
+		/*!
+		 *  Append the next block. data must hold ntraces * np / 2 values, which are
+		 *  multiplied by scale (0 meaning no scaling) and rounded for integer types.
+		 */
+		void writeBlock(const std::complex<float> *data, const short scale = 0, const int ctcount = 1);
+		void close(); //!< Throws if fewer blocks were written than promised in the header
+};
+
+} // End namespace Agilent
+
+#endif // AGILENT_FIDWRITER
@@ -0,0 +1,203 @@
+//
+//  fidsynth.cpp
+//  Part of Agilent Tools
+//
+//  Copyright (c) 2015 Tobias Wood
+//
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <algorithm>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "fidFile.h"
+#include "fidWriter.h"
+#include "procpar.h"
+
+using namespace std;
+using namespace Eigen;
+using namespace Agilent;
+
+void addReal(ProcPar &pp, const string &name, const ArrayXd &vals, const Parameter::SubType st = Parameter::SubType::Real) {
+    pp.insert(Parameter(name, st, vals, ArrayXd(), 2, 1, 1e18, -1e18, 0, 0, 1, 0));
+}
+
+void addReal(ProcPar &pp, const string &name, const double val, const Parameter::SubType st = Parameter::SubType::Real) {
+    addReal(pp, name, ArrayXd::Constant(1, val), st);
+}
+
+void addString(ProcPar &pp, const string &name, const string &val) {
+    pp.insert(Parameter(name, Parameter::SubType::String, vector<string>{val}, vector<string>(), 2, 1, 8, 0, 0, 0, 1, 0));
+}
+
+static struct option long_options[] = {
+    {"seq", required_argument, 0, 's'},
+    {"type", required_argument, 0, 't'},
+    {"nx", required_argument, 0, 'x'},
+    {"ny", required_argument, 0, 'y'},
+    {"nz", required_argument, 0, 'z'},
+    {"ne", required_argument, 0, 'e'},
+    {"narray", required_argument, 0, 'a'},
+    {"nseg", required_argument, 0, 'g'},
+    {"nti", required_argument, 0, 'n'},
+    {"echo-fraction", required_argument, 0, 'f'},
+    {"scale", required_argument, 0, 'c'},
+    {"nbheaders", required_argument, 0, 'b'},
+    {"seed", required_argument, 0, 'r'},
+    {"verbose", no_argument, 0, 'v'},
+    {0, 0, 0, 0}
+};
+static const char *short_options = "s:t:x:y:z:e:a:g:n:f:c:b:r:v";
+const string usage {
+"fidsynth - Write a synthetic Agilent fid bundle, e.g. for benchmarking fid2nii.\n\
+\n\
+Usage: fidsynth [opts] output.fid\n\
+The sample values are uniform noise from a seeded generator, so bundles are reproducible.\n\
+Options:\n\
+    --seq, -s S       : mge3d (default) or mp3rage.\n\
+    --type, -t T      : Sample type, int16 (default), int32 or float.\n\
+    --nx, --ny, --nz N : Matrix size (default 64 64 64).\n\
+    --ne, -e N        : Echoes per block (mge3d, default 1).\n\
+    --narray, -a N    : Array elements, which is the number of blocks (mge3d, default 1).\n\
+    --nseg, -g N      : Segments (mp3rage, default 1).\n\
+    --nti, -n N       : Inversion times, 2 or 3 (mp3rage, default 2).\n\
+    --echo-fraction, -f X : Fraction of each readout acquired (mp3rage, default 1).\n\
+    --scale, -c N     : Block header scale (default 0, no scaling).\n\
+    --nbheaders, -b N : Block headers per block (default 1).\n\
+    --seed, -r N      : Seed for the sample values (default 0).\n\
+    --verbose, -v     : Print progress."
+};
+
+int main(int argc, char **argv) {
+    int indexptr = 0, c;
+    string seq = "mge3d";
+    FIDFile::FIDType type = FIDFile::Int16Type;
+    int nx = 64, ny = 64, nz = 64, ne = 1, narray = 1, nseg = 1, nti = 2, nbheaders = 1;
+    short scale = 0;
+    double echo_fraction = 1.0;
+    unsigned seed = 0;
+    bool verbose = false;
+
+    while ((c = getopt_long(argc, argv, short_options, long_options, &indexptr)) != -1) {
+        switch (c) {
+        case 's': seq = string(optarg); break;
+        case 't': {
+            const string t(optarg);
+            if (t == "int16") type = FIDFile::Int16Type;
+            else if (t == "int32") type = FIDFile::Int32Type;
+            else if (t == "float") type = FIDFile::Float32Type;
+            else {
+                cerr << "Unknown sample type: " << t << endl;
+                return EXIT_FAILURE;
+            }
+        } break;
+        case 'x': nx = atoi(optarg); break;
+        case 'y': ny = atoi(optarg); break;
+        case 'z': nz = atoi(optarg); break;
+        case 'e': ne = atoi(optarg); break;
+        case 'a': narray = atoi(optarg); break;
+        case 'g': nseg = atoi(optarg); break;
+        case 'n': nti = atoi(optarg); break;
+        case 'f': echo_fraction = atof(optarg); break;
+        case 'c': scale = atoi(optarg); break;
+        case 'b': nbheaders = atoi(optarg); break;
+        case 'r': seed = atoi(optarg); break;
+        case 'v': verbose = true; break;
+        case '?': // getopt will print an error message
+            cout << usage << endl;
+            return EXIT_FAILURE;
+        default:
+            cout << "Unhandled option " << string(1, c) << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((argc - optind) != 1) {
+        cout << usage << endl;
+        cout << "Specify exactly one output .fid" << endl;
+        return EXIT_FAILURE;
+    }
+    string outPath(argv[optind]);
+    if (outPath.back() == '/')
+        outPath.resize(outPath.size() - 1);
+    if ((outPath.size() < 4) || (outPath.substr(outPath.size() - 4) != ".fid")) {
+        cerr << outPath << " does not end in .fid" << endl;
+        return EXIT_FAILURE;
+    }
+    if ((nx < 1) || (ny < 1) || (nz < 1) || (ne < 1) || (narray < 1) || (nseg < 1) ||
+        (ny % nseg) || (nti < 2) || (nti > 3) || (echo_fraction <= 0) || (echo_fraction > 1)) {
+        cerr << "Invalid dimensions" << endl;
+        return EXIT_FAILURE;
+    }
+
+    ProcPar pp;
+    addString(pp, "apptype", "im3D");
+    addString(pp, "seqcon", "ccccn");
+    addString(pp, "seqfil", seq);
+    addReal(pp, "nv", ny, Parameter::SubType::Int);
+    addReal(pp, "nv2", nz, Parameter::SubType::Int);
+    addReal(pp, "ns", 1, Parameter::SubType::Int);
+    addReal(pp, "lro", 2.56); addReal(pp, "lpe", 2.56); addReal(pp, "lpe2", 2.56);
+    addReal(pp, "pro", 0);    addReal(pp, "ppe", 0);    addReal(pp, "ppe2", 0);
+    addReal(pp, "pss", 0);    addReal(pp, "thk", 1);    addReal(pp, "gap", 0);
+    addReal(pp, "psi", 0);    addReal(pp, "phi", 0);    addReal(pp, "theta", 0);
+
+    int nblocks, ntraces, np;
+    if (seq == "mge3d") {
+        nblocks = narray;
+        ntraces = ny * nz * ne;
+        np = 2 * nx;
+        addReal(pp, "np", np, Parameter::SubType::Int);
+        addReal(pp, "ne", ne, Parameter::SubType::Int);
+        addReal(pp, "arraydim", narray, Parameter::SubType::Int);
+    } else if (seq == "mp3rage") {
+        nblocks = nz;
+        ntraces = ny * nti;
+        np = 2 * static_cast<int>(nx * echo_fraction + 0.5);
+        addReal(pp, "np", np, Parameter::SubType::Int);
+        addReal(pp, "ne", 1, Parameter::SubType::Int);
+        addReal(pp, "arraydim", 1, Parameter::SubType::Int);
+        addReal(pp, "nseg", nseg, Parameter::SubType::Int);
+        addReal(pp, "echo_fraction", echo_fraction);
+        addString(pp, "mp3rage_flag", (nti == 3) ? "y" : "n");
+        // A shuffled phase-encode table covering every line once
+        ArrayXd pelist(ny);
+        for (int y = 0; y < ny; y++)
+            pelist[y] = y - ny / 2;
+        mt19937 shuffler(seed);
+        shuffle(pelist.data(), pelist.data() + ny, shuffler);
+        addReal(pp, "pelist", pelist, Parameter::SubType::Int);
+    } else {
+        cerr << "Unknown sequence: " << seq << endl;
+        return EXIT_FAILURE;
+    }
+
+    try {
+        mkdir(outPath.c_str(), 0777);
+        ofstream ppFile(outPath + "/procpar");
+        if (!(ppFile << pp))
+            throw(runtime_error("Could not write " + outPath + "/procpar"));
+        ppFile.close();
+
+        FIDWriter fid(outPath + "/fid", type, nblocks, ntraces, np, nbheaders);
+        vector<complex<float>> block(static_cast<size_t>(ntraces) * np / 2);
+        minstd_rand rng(seed);
+        // Keep the scaled values comfortably inside int16
+        const float amp = 8192.f / max<short>(scale, 1);
+        uniform_real_distribution<float> noise(-amp, amp);
+        for (int b = 0; b < nblocks; b++) {
+            if (verbose) cout << "Writing block " << b + 1 << " of " << nblocks << endl;
+            for (auto &v : block)
+                v = complex<float>(noise(rng), noise(rng));
+            fid.writeBlock(block.data(), scale);
+        }
+        fid.close();
+    } catch (exception &e) {
+        cerr << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -44,7 +44,7 @@ const string &Extension::CodeName(const int code) {
 }
 
 Extension::Extension(int code, vector<char> data) :
-	m_code(code), m_data(data)
+	m_code(code), m_data(std::move(data))
 {}
 Extension::Extension(int size, int code, char *data) :
 	m_code(code)
@@ -265,7 +265,7 @@ void File::clearExtensions() {
 
 int File::totalExtensionSize() {
 	int total = 0;
-	for (auto ext: m_extensions) {
+	for (auto &ext: m_extensions) {
 		total += ext.size();
 	}
 	return total;
@@ -307,7 +307,7 @@ void File::readExtensions()
 		if (m_file.read(dataBytes.data(), size - 8) < (size - 8)) {
 			throw(std::runtime_error("Could not read extension in file: " + headerPath()));
 		}
-		m_extensions.emplace_back(code, dataBytes);
+		m_extensions.emplace_back(code, std::move(dataBytes));
 
 		if (m_nii && (m_file.tell() > m_header.voxoffset())) {
 			throw(std::runtime_error("Went past start of voxel data while reading extensions in file: " + headerPath()));
@@ -324,7 +324,7 @@ void File::writeExtensions() {
 		throw(std::runtime_error("Could not write extender block to file: " + headerPath()));
 	}
 	
-	for (auto ext : m_extensions) {
+	for (auto &ext : m_extensions) {
 		if (ext.rawSize() > numeric_limits<int>::max()) {
 			throw(std::runtime_error("Extension is larger than File standard permits in file: " + headerPath()));
 		}
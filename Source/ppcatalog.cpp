@@ -0,0 +1,242 @@
+//
+//  ppcatalog.cpp
+//  Part of Agilent Tools
+//
+//  Copyright (c) 2015 Tobias Wood.
+//
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "procpar.h"
+#include "util.h"
+
+using namespace std;
+using namespace Agilent;
+
+static int verbose = false, full = false, countOnly = false;
+static int threads = 0;
+static vector<string> params, show;
+static struct option long_options[] =
+{
+	{"verbose", no_argument, &verbose, true},
+	{"full", no_argument, &full, true},
+	{"count", no_argument, &countOnly, true},
+	{"params", required_argument, 0, 'p'},
+	{"show", required_argument, 0, 's'},
+	{"threads", required_argument, 0, 'j'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0}
+};
+const string usage {
+"ppcatalog - Index procpar parameters across an archive and query them.\n\
+\n\
+Usage: ppcatalog build [opts] catalog dir1 dir2 ... dirN\n\
+       ppcatalog query [opts] catalog pred1 pred2 ... predN\n\
+\n\
+build finds every .fid and .img bundle under dir1 to dirN and writes their\n\
+parameters to catalog. If catalog already exists with the same --params, only\n\
+procpars that are new or have changed since are read, and bundles that have\n\
+gone are dropped.\n\
+ --params a,b, -p a,b : Only catalogue these parameters (default all).\n\
+ --full, -f           : Read every procpar again.\n\
+ --threads N, -j N    : Read procpars with N threads (default 0 for all cores).\n\
+\n\
+query prints the procpar paths where all the predicates are true. Predicates\n\
+are name op value, where op is one of = != < <= > >= or ~ (contains). Only the\n\
+first value of each parameter is catalogued, and scans without the parameter\n\
+never match. Remember to quote < and > from the shell.\n\
+ --show a,b, -s a,b   : Also print these parameters, tab separated.\n\
+ --count, -c          : Only print the number of matches.\n\
+\n\
+ --verbose, -v        : Print progress to stderr.\n"
+};
+
+vector<string> SplitList(const string &s) {
+	vector<string> items;
+	stringstream ss(s);
+	string item;
+	while (getline(ss, item, ',')) {
+		if (!item.empty())
+			items.push_back(item);
+	}
+	return items;
+}
+
+bool Stat(const string &path, Catalog::Scan &scan) {
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return false;
+	scan.path = path;
+	scan.size = info.st_size;
+	scan.mtime = info.st_mtim.tv_sec;
+	scan.mtimeNs = info.st_mtim.tv_nsec;
+	return true;
+}
+
+int Build(const string &catalogPath, const vector<string> &roots) {
+	vector<string> paths;
+	for (auto &r : roots) {
+		const vector<string> found = FindBundleProcpars(r);
+		paths.insert(paths.end(), found.begin(), found.end());
+	}
+	sort(paths.begin(), paths.end());
+	paths.erase(unique(paths.begin(), paths.end()), paths.end());
+	if (verbose)
+		cerr << "Found " << paths.size() << " bundles" << endl;
+
+	unique_ptr<Catalog> previous;
+	struct stat info;
+	if (!full && (stat(catalogPath.c_str(), &info) == 0)) {
+		try {
+			previous.reset(new Catalog(catalogPath));
+		} catch (exception &e) {
+			cerr << e.what() << ", rebuilding it" << endl;
+		}
+	}
+	// Kept rows would have no values for parameters added to the list
+	CatalogBuilder builder(params);
+	if (previous && (previous->params() != builder.params())) {
+		if (verbose)
+			cerr << "Parameter list has changed, reading every procpar again" << endl;
+		previous.reset();
+	}
+	unordered_map<string, size_t> previousRows;
+	if (previous) {
+		for (size_t r = 0; r < previous->rows(); r++)
+			previousRows[previous->scan(r).path] = r;
+	}
+
+	// Keep the rows of procpars that have not changed, read the rest
+	vector<size_t> keep;
+	vector<Catalog::Scan> changed;
+	for (auto &p : paths) {
+		Catalog::Scan scan;
+		if (!Stat(p, scan))
+			continue;
+		auto it = previousRows.find(p);
+		if (it != previousRows.end()) {
+			const Catalog::Scan &old = previous->scan(it->second);
+			if ((old.size == scan.size) && (old.mtime == scan.mtime) && (old.mtimeNs == scan.mtimeNs)) {
+				keep.push_back(it->second);
+				continue;
+			}
+		}
+		changed.push_back(scan);
+	}
+	if (verbose)
+		cerr << keep.size() << " unchanged, " << changed.size() << " to read" << endl;
+
+	if (previous)
+		builder.copy(*previous, keep);
+	// Read in batches so that only a batch of ProcPars is held at once
+	const size_t batch = 1024;
+	size_t failures = 0;
+	for (size_t start = 0; start < changed.size(); start += batch) {
+		const size_t n = min(batch, changed.size() - start);
+		vector<ProcPar> pps(n);
+		vector<string> errors(n);
+		ParallelFor(static_cast<int>(n), threads, [&](const int i, const int) {
+			try {
+				pps[i] = ProcPar::Load(changed[start + i].path);
+			} catch (exception &e) {
+				errors[i] = e.what();
+			}
+		});
+		for (size_t i = 0; i < n; i++) {
+			if (errors[i].empty()) {
+				try {
+					builder.add(changed[start + i], pps[i]);
+					continue;
+				} catch (exception &e) {
+					errors[i] = e.what();
+				}
+			}
+			// Left out, so it will be tried again next time
+			cerr << changed[start + i].path << ": " << errors[i] << endl;
+			failures++;
+		}
+		if (verbose)
+			cerr << "Read " << start + n << " of " << changed.size() << endl;
+	}
+	builder.write(catalogPath);
+	if (verbose || failures)
+		cerr << "Catalogued " << builder.rows() << " scans, " << failures << " could not be read" << endl;
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int Query(const string &catalogPath, const vector<string> &predicates) {
+	const Catalog catalog(catalogPath);
+	vector<Catalog::Predicate> preds;
+	for (auto &p : predicates)
+		preds.push_back(Catalog::Predicate::Parse(p));
+	for (auto &s : show) {
+		if (!catalog.contains(s))
+			throw(runtime_error("Parameter " + s + " is not in catalog " + catalogPath));
+	}
+	const vector<size_t> rows = catalog.query(preds);
+	if (countOnly) {
+		cout << rows.size() << endl;
+	} else {
+		for (auto r : rows) {
+			cout << catalog.scan(r).path;
+			for (auto &s : show)
+				cout << "\t" << catalog.print(s, r);
+			cout << "\n";
+		}
+	}
+	if (verbose)
+		cerr << rows.size() << " of " << catalog.rows() << " scans matched" << endl;
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		cout << usage << endl;
+		return EXIT_FAILURE;
+	}
+	const string command(argv[1]);
+	argc--; argv++;
+	int indexptr = 0, c;
+	while ((c = getopt_long(argc, argv, "vfcp:s:j:h", long_options, &indexptr)) != -1) {
+		switch (c) {
+			case 0: break; // It was an option that just sets a flag.
+			case 'v': verbose = true; break;
+			case 'f': full = true; break;
+			case 'c': countOnly = true; break;
+			case 'p': params = SplitList(optarg); break;
+			case 's': show = SplitList(optarg); break;
+			case 'j': threads = atoi(optarg); break;
+			case 'h': cout << usage << endl; return EXIT_SUCCESS;
+			default: cout << usage << endl; return EXIT_FAILURE;
+		}
+	}
+	if ((argc - optind) <= 0) {
+		cout << "No catalog specified." << endl << usage << endl;
+		return EXIT_FAILURE;
+	}
+	const string catalogPath(argv[optind++]);
+	const vector<string> args(argv + optind, argv + argc);
+	try {
+		if (command == "build") {
+			if (args.empty()) {
+				cout << "No directories to catalogue." << endl << usage << endl;
+				return EXIT_FAILURE;
+			}
+			return Build(catalogPath, args);
+		} else if (command == "query") {
+			return Query(catalogPath, args);
+		}
+		cout << "Unknown command: " << command << endl << usage << endl;
+		return EXIT_FAILURE;
+	} catch (exception &e) {
+		cerr << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+}
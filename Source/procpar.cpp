@@ -7,6 +7,15 @@
 //
 
 #include "procpar.h"
+#include "scanGeometry.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
 
 using namespace std;
 using namespace Eigen;
@@ -16,13 +25,17 @@ namespace Agilent {
 //******************************************************************************
 #pragma mark Constructors
 //******************************************************************************
-Parameter::Parameter()
+Parameter::Parameter() :
+	m_type(Type::Real), m_subtype(SubType::Real),
+	m_max(0), m_min(0), m_step(0),
+	m_ggroup(0), m_dgroup(0), m_protection(0), m_active(0), m_intptr(0)
 {
 
 
 }
 
-Parameter::Parameter(const string &name, const SubType &st, const string &val)
+Parameter::Parameter(const string &name, const SubType &st, const string &val) :
+	Parameter()
 {
 	switch (st) {
 		case SubType::Real: case SubType::Delay: case SubType::Freq: case SubType::Pulse: case SubType::Int:
@@ -42,7 +55,7 @@ Parameter::Parameter(const string &name, const SubType &st, const string &val)
 
 // The default value of 8 for max is taken from observations of procpar
 Parameter::Parameter(const string &name, const SubType &st,
-					 const vector<string> &vals, const vector<string> &allowed = vector<string>(),
+					 vector<string> vals, vector<string> allowed = vector<string>(),
 					 const int ggroup = 0, const int dgroup = 0,
 					 const double max = 8,
 					 const double min = 0,
@@ -64,11 +77,12 @@ Parameter::Parameter(const string &name, const SubType &st,
 	m_name = name;
 	m_subtype = st;
 	m_type = Type::String;
-	m_stringValues = vals;
-	m_stringAllowed = allowed;
+	m_stringValues = move(vals);
+	m_stringAllowed = move(allowed);
 }
 
-Parameter::Parameter(const string &name, const SubType &st, const double &val)
+Parameter::Parameter(const string &name, const SubType &st, const double &val) :
+	Parameter()
 {
 	switch (st) {
 		case SubType::Real: case SubType::Delay: case SubType::Freq: case SubType::Pulse: case SubType::Int:
@@ -86,7 +100,7 @@ Parameter::Parameter(const string &name, const SubType &st, const double &val)
 }
 
 Parameter::Parameter(const string &name, const SubType &st,
-                     const ArrayXd &vals, const ArrayXd &allowed,
+                     ArrayXd vals, ArrayXd allowed,
 					 const int ggroup = 0, const int dgroup = 0,
 					 const double max = numeric_limits<double>::max(),
 					 const double min = -numeric_limits<double>::max(),
@@ -108,11 +122,12 @@ Parameter::Parameter(const string &name, const SubType &st,
 	m_name = name;
 	m_type = Type::Real;
 	m_subtype = st;
-	m_realValues = vals;
-	m_realAllowed = allowed;
+	m_realValues = move(vals);
+	m_realAllowed = move(allowed);
 }
 
-Parameter::Parameter(const string &name, const SubType &st, const int n)
+Parameter::Parameter(const string &name, const SubType &st, const int n) :
+	Parameter()
 {
 	m_name = name;
 	m_subtype = st;
@@ -196,6 +211,7 @@ const ArrayXd &Parameter::realValues() const {
 //******************************************************************************
 const string Parameter::print_values() const {
 	stringstream ss;
+	ss.precision(numeric_limits<double>::max_digits10);
 	
 	if (m_type == Type::Real) {
 		for (ArrayXd::Index i = 0; i < m_realValues.rows(); i++)
@@ -211,10 +227,11 @@ const string Parameter::print_values() const {
 
 const string Parameter::print_allowed() const {
 	stringstream ss;
+	ss.precision(numeric_limits<double>::max_digits10);
 	
 	if (m_type == Type::Real) {
 		for (ArrayXd::Index i = 0; i < m_realAllowed.rows(); i++)
-			ss << m_realAllowed(i);
+			ss << m_realAllowed(i) << " ";
 	} else {
 		for (auto &s: m_stringAllowed)
 			ss << "\"" << s << "\" ";
@@ -345,22 +362,398 @@ const bool Parameter::operator==(const Parameter &other) {
 }
 
 const bool Parameter::operator!=(const Parameter &other) { return !(operator==(other)); }
+//******************************************************************************
+#pragma mark Binary form
+//******************************************************************************
+namespace {
+
+template<typename T> void Put(string &out, const T &v) {
+	out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+void PutString(string &out, const string &v) {
+	Put(out, static_cast<uint32_t>(v.size()));
+	out.append(v);
+}
+
+template<typename T> T Get(const char *&p, const char *end) {
+	if (static_cast<size_t>(end - p) < sizeof(T))
+		throw(runtime_error("Procpar cache is truncated"));
+	T v;
+	memcpy(&v, p, sizeof(T));
+	p += sizeof(T);
+	return v;
+}
+
+string GetString(const char *&p, const char *end) {
+	const uint32_t n = Get<uint32_t>(p, end);
+	if (static_cast<size_t>(end - p) < n)
+		throw(runtime_error("Procpar cache is truncated"));
+	string v(p, n);
+	p += n;
+	return v;
+}
+
+} // End anonymous namespace
+
+/*
+ *  Native byte order, as caches are only ever read on the machine that wrote
+ *  them. The name comes first so an index can be built without decoding more.
+ */
+void Parameter::serialise(string &out) const {
+	PutString(out, m_name);
+	Put(out, static_cast<uint32_t>(m_subtype));
+	Put(out, static_cast<uint32_t>(m_type));
+	Put(out, m_max); Put(out, m_min); Put(out, m_step);
+	for (const int32_t v : {m_ggroup, m_dgroup, m_protection, m_active, m_intptr})
+		Put(out, v);
+	if (m_type == Type::Real) {
+		Put(out, static_cast<uint32_t>(m_realValues.size()));
+		out.append(reinterpret_cast<const char *>(m_realValues.data()), m_realValues.size() * sizeof(double));
+		Put(out, static_cast<uint32_t>(m_realAllowed.size()));
+		out.append(reinterpret_cast<const char *>(m_realAllowed.data()), m_realAllowed.size() * sizeof(double));
+	} else {
+		Put(out, static_cast<uint32_t>(m_stringValues.size()));
+		for (auto &v : m_stringValues)
+			PutString(out, v);
+		Put(out, static_cast<uint32_t>(m_stringAllowed.size()));
+		for (auto &v : m_stringAllowed)
+			PutString(out, v);
+	}
+}
+
+Parameter Parameter::Deserialise(const char *&p, const char *end) {
+	Parameter r;
+	r.m_name = GetString(p, end);
+	r.m_subtype = static_cast<SubType>(Get<uint32_t>(p, end));
+	r.m_type = static_cast<Type>(Get<uint32_t>(p, end));
+	r.m_max = Get<double>(p, end);
+	r.m_min = Get<double>(p, end);
+	r.m_step = Get<double>(p, end);
+	r.m_ggroup = Get<int32_t>(p, end);
+	r.m_dgroup = Get<int32_t>(p, end);
+	r.m_protection = Get<int32_t>(p, end);
+	r.m_active = Get<int32_t>(p, end);
+	r.m_intptr = Get<int32_t>(p, end);
+	if (r.m_type == Type::Real) {
+		for (ArrayXd *a : {&r.m_realValues, &r.m_realAllowed}) {
+			const uint32_t n = Get<uint32_t>(p, end);
+			if (static_cast<size_t>(end - p) / sizeof(double) < n)
+				throw(runtime_error("Procpar cache is truncated"));
+			a->resize(n);
+			if (n) // data() is null for an empty array
+				memcpy(a->data(), p, n * sizeof(double));
+			p += n * sizeof(double);
+		}
+	} else if (r.m_type == Type::String) {
+		for (vector<string> *v : {&r.m_stringValues, &r.m_stringAllowed}) {
+			const uint32_t n = Get<uint32_t>(p, end);
+			v->reserve(n);
+			for (uint32_t i = 0; i < n; i++)
+				v->push_back(GetString(p, end));
+		}
+	} else {
+		throw(runtime_error("Invalid type for parameter " + r.m_name + " in procpar cache"));
+	}
+	return r;
+}
+
 //******************************************************************************
 #pragma mark ProcPar Class
 //******************************************************************************
+namespace {
+
+/*
+ *  Single pass scanner over a whole procpar held in memory, which is much faster
+ *  than formatted istream extraction. Tokens are separated by whitespace, and
+ *  strings are delimited by double quotes with no escapes. The buffer must be
+ *  NUL terminated so that strtod cannot run off the end.
+ */
+class Scanner {
+	private:
+		const char *m_p, *m_end, *m_begin;
+
+		static bool isSpace(const char c) {
+			return (c == ' ') || (c == '\n') || (c == '\t') || (c == '\r') || (c == '\v') || (c == '\f');
+		}
+
+	public:
+		Scanner(const string &buffer) :
+			m_p(buffer.c_str()), m_end(buffer.c_str() + buffer.size()), m_begin(buffer.c_str()) {}
+		Scanner(const char *buffer, const size_t size, const size_t offset) :
+			m_p(buffer + offset), m_end(buffer + size), m_begin(buffer) {}
+
+		size_t offset() const { return m_p - m_begin; }
+
+		void skipSpace() {
+			while ((m_p < m_end) && isSpace(*m_p))
+				m_p++;
+		}
+
+		bool atEnd() {
+			skipSpace();
+			return m_p == m_end;
+		}
+
+		bool token(string &out) {
+			skipSpace();
+			const char *start = m_p;
+			while ((m_p < m_end) && !isSpace(*m_p))
+				m_p++;
+			out.assign(start, m_p);
+			return m_p > start;
+		}
+
+		bool skipToken() {
+			skipSpace();
+			const char *start = m_p;
+			while ((m_p < m_end) && !isSpace(*m_p))
+				m_p++;
+			return m_p > start;
+		}
+
+		bool skipQuoted() {
+			skipSpace();
+			if ((m_p == m_end) || (*m_p != '\"'))
+				return false;
+			const char *close = static_cast<const char *>(memchr(m_p + 1, '\"', m_end - (m_p + 1)));
+			if (!close)
+				throw(runtime_error("Could not find a closing quote."));
+			m_p = close + 1;
+			return true;
+		}
+
+		bool integer(int &out) {
+			skipSpace();
+			char *stop;
+			const long v = strtol(m_p, &stop, 10);
+			if (stop == m_p)
+				return false;
+			m_p = stop;
+			out = static_cast<int>(v);
+			return true;
+		}
+
+		/*
+		 *  Most procpar numbers have few enough digits that mantissa * 10^exp is exact
+		 *  in a double, and then so is the result (Clinger's fast path). Anything else,
+		 *  including inf and nan, goes to strtod.
+		 */
+		bool real(double &out) {
+			static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			                                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+			skipSpace();
+			const char *p = m_p;
+			const bool negative = (p < m_end) && (*p == '-');
+			if ((p < m_end) && ((*p == '-') || (*p == '+')))
+				p++;
+			unsigned long long mantissa = 0;
+			int digits = 0, exponent = 0;
+			const char *first = p;
+			for (; (p < m_end) && (*p >= '0') && (*p <= '9'); p++, digits++)
+				mantissa = mantissa * 10 + (*p - '0');
+			if ((p < m_end) && (*p == '.')) {
+				for (p++; (p < m_end) && (*p >= '0') && (*p <= '9'); p++, digits++, exponent--)
+					mantissa = mantissa * 10 + (*p - '0');
+			}
+			const bool hasDigits = (p - first) > ((p > first) && (*(p - 1) == '.') ? 1 : 0);
+			if (hasDigits && (p < m_end) && ((*p == 'e') || (*p == 'E'))) {
+				const char *e = p + 1;
+				int sign = 1, value = 0;
+				if ((e < m_end) && ((*e == '-') || (*e == '+')))
+					sign = (*e++ == '-') ? -1 : 1;
+				const char *estart = e;
+				for (; (e < m_end) && (*e >= '0') && (*e <= '9') && (value < 10000); e++)
+					value = value * 10 + (*e - '0');
+				if (e > estart) {
+					exponent += sign * value;
+					p = e;
+				}
+			}
+			if (hasDigits && (digits <= 15) && (exponent >= -22) && (exponent <= 22) &&
+			    ((p == m_end) || isSpace(*p))) {
+				double v = static_cast<double>(mantissa);
+				v = (exponent < 0) ? v / pow10[-exponent] : v * pow10[exponent];
+				out = negative ? -v : v;
+				m_p = p;
+				return true;
+			}
+			char *stop;
+			out = strtod(m_p, &stop);
+			if (stop == m_p)
+				return false;
+			m_p = stop;
+			return true;
+		}
+
+		bool quoted(string &out) {
+			skipSpace();
+			if ((m_p == m_end) || (*m_p != '\"'))
+				return false;
+			const char *start = ++m_p;
+			while ((m_p < m_end) && (*m_p != '\"'))
+				m_p++;
+			if (m_p == m_end)
+				throw(runtime_error("Could not find a closing quote."));
+			out.assign(start, m_p++);
+			return true;
+		}
+};
+
+/*
+ *  Read the next parameter from sc into p. Returns false if there is no complete
+ *  definition line left, as procpar files have a trailing line.
+ */
+bool ScanParameter(Scanner &sc, Parameter &p) {
+	string name;
+	int subtype_in, type_in, ggroup, dgroup, protection, active, intptr, nvals, nallowed;
+	double max, min, step;
+	if (!sc.token(name))
+		return false;
+	if (!(sc.integer(subtype_in) && sc.integer(type_in) &&
+	      sc.real(max) && sc.real(min) && sc.real(step) &&
+	      sc.integer(ggroup) && sc.integer(dgroup) && sc.integer(protection) &&
+	      sc.integer(active) && sc.integer(intptr))) {
+		if (sc.atEnd())
+			return false;
+		throw(runtime_error("Error while reading parameter definition line."));
+	}
+	const Parameter::Type type = static_cast<Parameter::Type>(type_in);
+	const Parameter::SubType subtype = static_cast<Parameter::SubType>(subtype_in);
+	if ((type != Parameter::Type::Real) && (type != Parameter::Type::String))
+		throw(runtime_error("Invalid type value for parameter " + name + ", no values read"));
+	if (!sc.integer(nvals) || (nvals < 0))
+		throw(runtime_error("Failed while reading number of values for parameter " + name));
+	if (type == Parameter::Type::Real) {
+		ArrayXd realValues(nvals), realAllowed;
+		for (int i = 0; i < nvals; i++) {
+			if (!sc.real(realValues[i]))
+				throw(runtime_error("Failed while reading values for parameter " + name + " from procpar file"));
+		}
+		if (!sc.integer(nallowed) || (nallowed < 0))
+			throw(runtime_error("Failed while reading number of allowed values for parameter " + name));
+		realAllowed.resize(nallowed);
+		for (int i = 0; i < nallowed; i++) {
+			if (!sc.real(realAllowed[i]))
+				throw(runtime_error("Failed while reading allowed values for parameter " + name + " from procpar file"));
+		}
+		p = Parameter(name, subtype, move(realValues), move(realAllowed),
+		              ggroup, dgroup, max, min, step, protection, active, intptr);
+	} else {
+		vector<string> stringValues(nvals), stringAllowed;
+		for (int i = 0; i < nvals; i++) {
+			if (!sc.quoted(stringValues[i]))
+				throw(runtime_error("Could not find an opening quote."));
+		}
+		if (!sc.integer(nallowed) || (nallowed < 0))
+			throw(runtime_error("Failed while reading number of allowed values for parameter " + name));
+		stringAllowed.resize(nallowed);
+		for (int i = 0; i < nallowed; i++) {
+			if (!sc.quoted(stringAllowed[i]))
+				throw(runtime_error("Could not find an opening quote."));
+		}
+		p = Parameter(name, subtype, move(stringValues), move(stringAllowed),
+		              ggroup, dgroup, max, min, step, protection, active, intptr);
+	}
+	return true;
+}
+
+/*
+ *  Skip over the next parameter in sc, recording its name and where it starts,
+ *  without converting any values. Returns false as ScanParameter does.
+ */
+bool IndexParameter(Scanner &sc, string &name, size_t &offset) {
+	sc.skipSpace();
+	offset = sc.offset();
+	if (!sc.token(name))
+		return false;
+	int subtype_in, type_in, nvals, nallowed;
+	if (!(sc.integer(subtype_in) && sc.integer(type_in))) {
+		if (sc.atEnd())
+			return false;
+		throw(runtime_error("Error while reading parameter definition line."));
+	}
+	for (int i = 0; i < 8; i++) {
+		if (!sc.skipToken())
+			return false;
+	}
+	const Parameter::Type type = static_cast<Parameter::Type>(type_in);
+	if ((type != Parameter::Type::Real) && (type != Parameter::Type::String))
+		throw(runtime_error("Invalid type value for parameter " + name + ", no values read"));
+	const bool quoted = (type == Parameter::Type::String);
+	if (!sc.integer(nvals) || (nvals < 0))
+		throw(runtime_error("Failed while reading number of values for parameter " + name));
+	for (int i = 0; i < nvals; i++) {
+		if (!(quoted ? sc.skipQuoted() : sc.skipToken()))
+			throw(runtime_error("Failed while reading values for parameter " + name + " from procpar file"));
+	}
+	if (!sc.integer(nallowed) || (nallowed < 0))
+		throw(runtime_error("Failed while reading number of allowed values for parameter " + name));
+	for (int i = 0; i < nallowed; i++) {
+		if (!(quoted ? sc.skipQuoted() : sc.skipToken()))
+			throw(runtime_error("Failed while reading allowed values for parameter " + name + " from procpar file"));
+	}
+	return true;
+}
+
+} // End anonymous namespace
+
 /*
- *  Extracts entire ProcPar into p
+ *  Extracts entire ProcPar into p. The whole stream is read into memory first and
+ *  then scanned in one pass.
  */
 istream &operator>>(istream &is, ProcPar &pp) {
-	Parameter p;
-	while(is >> p)
-		pp.insert(p);
+	string buffer;
+	const streampos start = is.tellg();
+	if ((start != streampos(-1)) && is.seekg(0, ios::end)) {
+		// Seekable, so read the rest in one go
+		buffer.resize(static_cast<size_t>(is.tellg() - start));
+		is.seekg(start);
+		is.read(&buffer[0], buffer.size());
+	} else {
+		is.clear();
+		buffer.assign(istreambuf_iterator<char>(is), istreambuf_iterator<char>());
+	}
+	is.setstate(ios::eofbit); // Callers check this to see that everything was read
+	pp.read(buffer);
 	return is;
 }
 
+void ProcPar::read(const string &buffer, const bool lazy) {
+	if (!lazy) {
+		Scanner sc(buffer);
+		Parameter p;
+		while (ScanParameter(sc, p))
+			insert(move(p));
+		return;
+	}
+	// Any parameters from an earlier lazy read keep their own copy of its text
+	const auto text = make_shared<const string>(buffer);
+	const shared_ptr<const char> source(text, text->c_str());
+	Scanner sc(*text);
+	string name;
+	size_t offset;
+	while (IndexParameter(sc, name, offset)) {
+		if (contains(name))
+			continue;
+		auto e = make_shared<Entry>();
+		e->name = name;
+		e->source = source;
+		e->size = text->size();
+		e->offset = offset;
+		e->binary = false;
+		add(e);
+	}
+}
+
+void ProcPar::materialise() const {
+	for (auto &e : m_parameters)
+		value(*e);
+}
+
 ostream &operator<<(ostream &os, const ProcPar &pp) {
-	for (auto &p : pp.m_parameters)
-		os << p.second << endl;
+	for (auto &n : pp.names())
+		os << pp.parameter(n) << endl;
 	return os;
 }
 
@@ -371,20 +764,92 @@ ProcPar::operator bool() const {
 	return (m_parameters.size() > 0);
 }
 
+uint32_t ProcPar::Hash(const string &name) {
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (const char c : name) {
+		h ^= static_cast<unsigned char>(c);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+size_t ProcPar::find(const string &name) const {
+	if (m_slots.empty())
+		return m_parameters.size();
+	const uint32_t h = Hash(name);
+	const size_t mask = m_slots.size() - 1;
+	for (size_t i = h & mask; m_slots[i].index != 0; i = (i + 1) & mask) {
+		const Slot &s = m_slots[i];
+		if ((s.hash == h) && (m_parameters[s.index - 1]->name == name))
+			return s.index - 1;
+	}
+	return m_parameters.size();
+}
+
+void ProcPar::addSlot(const uint32_t hash, const size_t index) {
+	const size_t mask = m_slots.size() - 1;
+	size_t i = hash & mask;
+	while (m_slots[i].index != 0)
+		i = (i + 1) & mask;
+	m_slots[i] = Slot{hash, static_cast<uint32_t>(index + 1)};
+}
+
+void ProcPar::rehash(const size_t nslots) {
+	m_slots.assign(nslots, Slot{0, 0});
+	for (size_t i = 0; i < m_parameters.size(); i++)
+		addSlot(Hash(m_parameters[i]->name), i);
+}
+
 const bool ProcPar::contains(const string &name) const {
-	auto p = m_parameters.find(name);
-	if (p == m_parameters.end())
-		return false;
-	return true;
+	return find(name) < m_parameters.size();
 }
 
 void ProcPar::insert(const Parameter &p) {
-	m_parameters.insert(pair<string, Parameter>(p.name(), p));
+	insert(Parameter(p));
+}
+
+void ProcPar::insert(Parameter &&p) {
+	if (contains(p.name()))
+		return;
+	auto e = make_shared<Entry>();
+	e->name = p.name();
+	e->size = e->offset = 0;
+	e->binary = false;
+	e->value = move(p);
+	add(e);
+}
+
+void ProcPar::add(const shared_ptr<Entry> &e) {
+	// Keep the load factor at or below a half, slots are a power of two
+	if (2 * (m_parameters.size() + 1) > m_slots.size())
+		rehash(max<size_t>(64, 2 * m_slots.size()));
+	m_parameters.push_back(e);
+	addSlot(Hash(e->name), m_parameters.size() - 1);
+}
+
+const Parameter &ProcPar::value(Entry &entry) const {
+	call_once(entry.parsed, [&entry]() {
+		if (!entry.source)
+			return;
+		if (entry.binary) {
+			const char *p = entry.source.get() + entry.offset;
+			entry.value = Parameter::Deserialise(p, entry.source.get() + entry.size);
+		} else {
+			Scanner sc(entry.source.get(), entry.size, entry.offset);
+			if (!ScanParameter(sc, entry.value))
+				throw(runtime_error("Error while reading parameter " + entry.name));
+		}
+		entry.source.reset(); // Other entries still hold it if they need it
+	});
+	return entry.value;
 }
 
 void ProcPar::remove(const string &name) {
-	if (contains(name)) {
-		m_parameters.erase(m_parameters.find(name));
+	const size_t i = find(name);
+	if (i < m_parameters.size()) {
+		m_parameters.erase(m_parameters.begin() + i);
+		rehash(m_slots.size());
 	} else {
 		throw(runtime_error("Tried to remove non-existent parameter " + name));
 	}
@@ -394,104 +859,283 @@ size_t ProcPar::count() const {
 	return m_parameters.size();
 }
 
-const Parameter &ProcPar::parameter(const string &name) const {
-	return m_parameters.find(name)->second;
+ParamRef ProcPar::ref(const string &name) const {
+	const size_t i = find(name);
+	return (i < m_parameters.size()) ? ParamRef(i) : ParamRef();
+}
+
+const Parameter &ProcPar::get(const string &name) const {
+	const size_t i = find(name);
+	if (i == m_parameters.size())
+		throw(invalid_argument("Could not find parameter " + name));
+	return value(*m_parameters[i]);
 }
 
+const Parameter &ProcPar::get(const ParamRef &ref) const {
+	if (ref.m_index >= m_parameters.size())
+		throw(invalid_argument("Invalid parameter reference"));
+	return value(*m_parameters[ref.m_index]);
+}
+
+const Parameter &ProcPar::parameter(const string &name) const { return get(name); }
+const Parameter &ProcPar::parameter(const ParamRef &ref) const { return get(ref); }
+
 const vector<string> ProcPar::names() const {
 	vector<string> n;
 	n.reserve(m_parameters.size());
-	for (auto &p : m_parameters)
-		n.emplace_back(p.first);
+	for (auto &e : m_parameters)
+		n.emplace_back(e->name);
+	sort(n.begin(), n.end());
 	return n;
 }
 
-const double ProcPar::realValue(const string &name, const size_t index) const {
-	auto p = m_parameters.find(name);
-	if (p == m_parameters.end())
-		throw(invalid_argument("Could not find parameter " + name));
-	else
-		return p->second.realValue(index);
+const string &ProcPar::name(const size_t i) const {
+	if (i >= m_parameters.size())
+		throw(out_of_range("Parameter index " + to_string(i) + " is out of range"));
+	return m_parameters[i]->name;
 }
 
-const ArrayXd &ProcPar::realValues(const string &name) const {
-	auto p = m_parameters.find(name);
-	if (p == m_parameters.end())
-		throw(invalid_argument("Could not find parameter " + name));
-	else
-		return p->second.realValues();
+const double ProcPar::realValue(const string &name, const size_t index) const { return get(name).realValue(index); }
+const double ProcPar::realValue(const ParamRef &ref, const size_t index) const { return get(ref).realValue(index); }
+const ArrayXd &ProcPar::realValues(const string &name) const { return get(name).realValues(); }
+const ArrayXd &ProcPar::realValues(const ParamRef &ref) const { return get(ref).realValues(); }
+const string &ProcPar::stringValue(const string &name, const size_t index) const { return get(name).stringValue(index); }
+const string &ProcPar::stringValue(const ParamRef &ref, const size_t index) const { return get(ref).stringValue(index); }
+const vector<string> &ProcPar::stringValues(const string &name) const { return get(name).stringValues(); }
+const vector<string> &ProcPar::stringValues(const ParamRef &ref) const { return get(ref).stringValues(); }
+
+namespace {
+
+const char CacheMagic[8] = {'A', 'G', 'P', 'P', 'C', 'A', 'C', 'H'};
+const uint32_t CacheVersion = 1;
+const uint32_t CacheEndian = 0x01020304; //!< Reads back differently if the byte order is different
+
+/*
+ *  The layout is this header, the parameters one after another, then a table
+ *  of count offsets to them starting at table.
+ */
+struct CacheHeader {
+	char magic[8];
+	uint32_t version, endian;
+	uint64_t sourceSize;
+	int64_t sourceTime, sourceTimeNs;
+	uint64_t count, table;
+};
+
+bool SourceKey(const string &path, CacheHeader &hdr) {
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return false;
+	hdr.sourceSize = info.st_size;
+	hdr.sourceTime = info.st_mtim.tv_sec;
+	hdr.sourceTimeNs = info.st_mtim.tv_nsec;
+	return true;
 }
 
-const string &ProcPar::stringValue(const string &name, const size_t index) const {
-	auto p = m_parameters.find(name);
-	if (p == m_parameters.end())
-		throw(invalid_argument("Could not find parameter " + name));
-	else
-		return p->second.stringValue(index);
+} // End anonymous namespace
+
+string ProcPar::CachePath(const string &path) {
+	const char *env = getenv("AGILENT_PROCPAR_CACHE");
+	if (!env)
+		return path + ".cache";
+	const string dir(env);
+	if (dir.empty() || (dir == "off"))
+		return "";
+	// One directory for everything, so name each cache by the procpar's full path
+	char *real = realpath(path.c_str(), nullptr);
+	const string key = real ? string(real) : path;
+	free(real);
+	uint64_t h = 14695981039346656037ull; // 64-bit FNV-1a
+	for (const char c : key) {
+		h ^= static_cast<unsigned char>(c);
+		h *= 1099511628211ull;
+	}
+	stringstream ss;
+	ss << dir << "/" << hex << h << ".ppcache";
+	return ss.str();
 }
 
-const vector<string> &ProcPar::stringValues(const string &name) const {
-	auto p = m_parameters.find(name);
-	if (p == m_parameters.end())
-		throw(invalid_argument("Could not find parameter " + name));
-	else
-		return p->second.stringValues();
+bool ProcPar::readCache(const string &cachePath, const string &sourcePath) {
+	CacheHeader source;
+	if (!SourceKey(sourcePath, source))
+		return false;
+	const int fd = ::open(cachePath.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat info;
+	void *addr = MAP_FAILED;
+	if ((fstat(fd, &info) == 0) && (static_cast<size_t>(info.st_size) >= sizeof(CacheHeader)))
+		addr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (addr == MAP_FAILED)
+		return false;
+	const size_t size = info.st_size;
+	const shared_ptr<const char> data(static_cast<const char *>(addr), [size](const char *p) {
+		munmap(const_cast<char *>(p), size);
+	});
+	CacheHeader hdr;
+	memcpy(&hdr, data.get(), sizeof(hdr));
+	if ((memcmp(hdr.magic, CacheMagic, sizeof(CacheMagic)) != 0) ||
+	    (hdr.version != CacheVersion) || (hdr.endian != CacheEndian) ||
+	    (hdr.sourceSize != source.sourceSize) || (hdr.sourceTime != source.sourceTime) ||
+	    (hdr.sourceTimeNs != source.sourceTimeNs) ||
+	    (hdr.table > size) || ((size - hdr.table) / sizeof(uint64_t) < hdr.count))
+		return false;
+	const char *end = data.get() + size;
+	const char *table = data.get() + hdr.table;
+	for (uint64_t i = 0; i < hdr.count; i++) {
+		const uint64_t offset = Get<uint64_t>(table, end);
+		if (offset >= hdr.table)
+			return false;
+		const char *p = data.get() + offset;
+		auto e = make_shared<Entry>();
+		e->name = GetString(p, end);
+		if (contains(e->name))
+			continue;
+		e->source = data;
+		e->size = size;
+		e->offset = offset;
+		e->binary = true;
+		add(e);
+	}
+	return true;
+}
+
+void ProcPar::writeCache(const string &cachePath, const string &sourcePath) const {
+	CacheHeader hdr;
+	if (!SourceKey(sourcePath, hdr))
+		throw(runtime_error("Could not stat " + sourcePath));
+	memcpy(hdr.magic, CacheMagic, sizeof(CacheMagic));
+	hdr.version = CacheVersion;
+	hdr.endian = CacheEndian;
+	hdr.count = m_parameters.size();
+	string out(sizeof(CacheHeader), '\0');
+	vector<uint64_t> table;
+	table.reserve(m_parameters.size());
+	for (auto &e : m_parameters) {
+		table.push_back(out.size());
+		value(*e).serialise(out);
+	}
+	hdr.table = out.size();
+	out.append(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(uint64_t));
+	memcpy(&out[0], &hdr, sizeof(hdr));
+	// Write then rename, so that nothing ever sees half a cache
+	const string tmpPath = cachePath + ".tmp" + to_string(getpid());
+	ofstream file(tmpPath, ios::binary);
+	if (!file.write(out.data(), out.size()) || (file.close(), !file)) {
+		std::remove(tmpPath.c_str());
+		throw(runtime_error("Could not write procpar cache " + cachePath));
+	}
+	if (rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+		std::remove(tmpPath.c_str());
+		throw(runtime_error("Could not write procpar cache " + cachePath));
+	}
+}
+
+ProcPar ProcPar::Load(const string &path) {
+	const string cachePath = CachePath(path);
+	if (!cachePath.empty()) {
+		// A failed read can leave some parameters added, so only keep a complete one
+		ProcPar cached;
+		try {
+			if (cached.readCache(cachePath, path))
+				return cached;
+		} catch (exception &) {
+			// A damaged cache is treated like a stale one, and replaced below
+		}
+	}
+	ProcPar pp;
+	ifstream file(path);
+	if (!file)
+		throw(runtime_error("Could not open " + path));
+	file >> pp;
+	if (!cachePath.empty()) {
+		try {
+			pp.writeCache(cachePath, path);
+		} catch (exception &) {
+			// Most likely a read-only archive, which is fine without a cache
+		}
+	}
+	return pp;
 }
 
 Affine3f ProcPar::calcTransform() const {
-    int slabs = static_cast<size_t>(parameter("pss").nvals()); // ns will be 1 for standard looping
-    int echoes = static_cast<size_t>(realValue("ne"));
-    Array3i dim;
-    dim[0] = realValue("np") / 2;
-    dim[1] = realValue("nv");
-    if (stringValue("apptype") == "im2D") {
-        dim[2] = realValue("ns");
-    } else {
-        dim[2] = realValue("nv2");
-    }
-
-    // Now we have the joy of calculating a correct orientation field
-    // Get "Euler" angles. These describe how to get to the user frame
-    // from the magnet frame.
-    double psi = realValue("psi"), phi = realValue("phi"),
-           tht = realValue("theta");
-
-    double sinphi = sin(phi*M_PI/180.), cosphi = cos(phi*M_PI/180.);
-    double sintht = sin(tht*M_PI/180.), costht = cos(tht*M_PI/180.);
-    double sinpsi = sin(psi*M_PI/180.), cospsi = cos(psi*M_PI/180.);
-
-    // Now for the vox dimensions and offsets in the user frame
-    // The offset for the RO axis appears to be negative versus the PE/PE2 axis
-    // Verified in a mouse dataset 13/11/21
-    Array3f voxdim, offset;
-    voxdim[0] = realValue("lro")/dim[0];
-    offset(0) = -realValue("pro") - (realValue("lro") - voxdim[0])/2.;
-    voxdim[1] = realValue("lpe")/dim[1];
-    offset(1) = realValue("ppe") - (realValue("lpe") - voxdim[1])/2.;
-    if (stringValue("apptype") == "im2D") {
-        voxdim[2] = realValue("thk")/10. + realValue("gap"); // thk seems to be in mm already
-        offset[2] = realValue("pss", 0); // Find the most negative slice center
-        for (size_t i = 1; i < slabs; i++) {
-            if (realValue("pss", i) < offset[2])
-                offset[2] = realValue("pss", i);
-        }
-    } else {
-        voxdim[2] = realValue("lpe2")/dim[2];
-        offset[2] = realValue("ppe2") - (realValue("lpe2") - voxdim[2])/2.;
-    }
-    // Now build the transform matrix - the 10 is to convert from cm to mm
-    voxdim *= 10.;
-    offset *= 10.;
-    Affine3f S; S = Scaling(voxdim[0], voxdim[1], voxdim[2]);
-    Affine3f T; T = Translation3f(offset[0], offset[1], offset[2]);
-    // From Michael Gyngell
-    Matrix3f Rd;
-    Rd << -cospsi*sinphi + sinpsi*costht*cosphi, -cospsi*cosphi - sinpsi*costht*sinphi, sinpsi*sintht,
-           sinpsi*sinphi + cospsi*costht*cosphi,  sinpsi*cosphi - cospsi*costht*sinphi, cospsi*sintht,
-          -sintht*cosphi, sintht*sinphi, costht;
-    Affine3f R(Rd);
-    Affine3f final = (R*T*S);
-    return final;
+	return ScanGeometry(*this).transform.cast<float>();
+}
+
+//******************************************************************************
+#pragma mark NIfTI extensions
+//******************************************************************************
+namespace {
+
+const char ZipMagic[4] = {'A', 'G', 'P', 'Z'};
+
+/*
+ *  Deflated extensions start with the magic, then the inflated and deflated
+ *  sizes as little-endian 32 bit integers, as extension data is never swapped.
+ */
+void PutLE32(vector<char> &out, const size_t offset, const uint32_t v) {
+	for (int i = 0; i < 4; i++)
+		out[offset + i] = static_cast<char>((v >> (8 * i)) & 0xFF);
+}
+
+uint32_t GetLE32(const vector<char> &in, const size_t offset) {
+	uint32_t v = 0;
+	for (int i = 0; i < 4; i++)
+		v |= static_cast<uint32_t>(static_cast<unsigned char>(in[offset + i])) << (8 * i);
+	return v;
+}
+
+} // End anonymous namespace
+
+vector<char> ProcParExtension(const string &path, const bool deflate) {
+	ifstream file(path, ios::binary | ios::ate);
+	if (!file)
+		throw(runtime_error("Could not open " + path));
+	const streamoff size = file.tellg();
+	file.seekg(0);
+	vector<char> text(size);
+	if (!file.read(text.data(), size))
+		throw(runtime_error("Could not read " + path));
+	if (!deflate)
+		return text;
+
+	uLongf packed = compressBound(text.size());
+	vector<char> out(12 + packed);
+	if (compress2(reinterpret_cast<Bytef *>(out.data() + 12), &packed,
+	              reinterpret_cast<const Bytef *>(text.data()), text.size(), Z_BEST_COMPRESSION) != Z_OK)
+		throw(runtime_error("Could not compress " + path));
+	out.resize(12 + packed);
+	copy(ZipMagic, ZipMagic + 4, out.begin());
+	PutLE32(out, 4, text.size());
+	PutLE32(out, 8, packed);
+	return out;
+}
+
+ProcPar ReadProcParExtension(const vector<char> &data, const bool deflated) {
+	string text;
+	if (deflated) {
+		if ((data.size() < 12) || !equal(ZipMagic, ZipMagic + 4, data.begin()))
+			throw(runtime_error("Compressed procpar extension has an invalid header"));
+		uLongf size = GetLE32(data, 4);
+		const uLong packed = GetLE32(data, 8);
+		if (packed > data.size() - 12)
+			throw(runtime_error("Compressed procpar extension is truncated"));
+		text.resize(size);
+		if ((uncompress(reinterpret_cast<Bytef *>(&text[0]), &size,
+		                reinterpret_cast<const Bytef *>(data.data() + 12), packed) != Z_OK) ||
+		    (size != text.size()))
+			throw(runtime_error("Could not decompress procpar extension"));
+	} else {
+		// Extensions are padded with zeros to a multiple of 16 bytes
+		size_t end = data.size();
+		while ((end > 0) && (data[end - 1] == '\0'))
+			end--;
+		text.assign(data.begin(), data.begin() + end);
+	}
+	ProcPar pp;
+	pp.read(text);
+	return pp;
 }
 
 }; // End namespace Agilent
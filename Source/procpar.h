@@ -15,9 +15,12 @@
 #include <fstream>
 #include <array>
 #include <vector>
-#include <map>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <algorithm>
 #include <exception>
+#include <limits>
 
 #include "Eigen/Core"
 #include "Eigen/Geometry"
@@ -49,12 +52,12 @@ namespace Agilent {
 			Parameter(const std::string &name, const SubType &st, const std::string &val); //!< Construct a string parameter with one value
 			Parameter(const std::string &name, const SubType &st, const double &val);      //!< Construct a string parameter with multiple values
 			Parameter(const std::string &name, const SubType &st,
-			          const std::vector<std::string> &vals, const std::vector<std::string> &allowed,
+			          std::vector<std::string> vals, std::vector<std::string> allowed,
 					  const int ggroup, const int dgroup,
 					  const double max, const double min, const double step,
 					  const int protection, const int active, const int intptr); //!< Construct a real parameter with one value
 			Parameter(const std::string &name, const SubType &st,
-			          const Eigen::ArrayXd &vals, const Eigen::ArrayXd &allowed,
+			          Eigen::ArrayXd vals, Eigen::ArrayXd allowed,
 					  const int ggroup, const int dgroup,
 					  const double max, const double min, const double step,
 					  const int protection, const int active, const int intptr); //!< Construct a real parameter with multiple values
@@ -76,35 +79,122 @@ namespace Agilent {
 			const std::string print_allowed() const;
 			const std::string print() const;
 			
+			void serialise(std::string &out) const; //!< Append a binary copy, as used by ProcPar caches
+			static Parameter Deserialise(const char *&p, const char *end); //!< Read a binary copy, advancing p past it
+
 			const bool operator==(const Parameter &other);
 			const bool operator!=(const Parameter &other);
 			friend std::ostream& operator<<(std::ostream &os, const Parameter &p);
 			friend std::istream& operator>>(std::istream &is, Parameter &p);
 	};
 	
+	/*
+	 *  A pre-resolved handle to a parameter in a ProcPar, so hot code can look a
+	 *  name up once and then read its values without hashing. Refs stay valid
+	 *  while parameters are inserted, but not after any are removed.
+	 */
+	class ParamRef {
+		private:
+			friend class ProcPar;
+			size_t m_index;
+			explicit ParamRef(const size_t i) : m_index(i) {}
+
+		public:
+			ParamRef() : m_index(static_cast<size_t>(-1)) {}
+			explicit operator bool() const { return m_index != static_cast<size_t>(-1); } //!< False if the name was not found
+	};
+
 	class ProcPar {
 		protected:
-			typedef std::map<std::string, Parameter> Parmap;
-			Parmap m_parameters;
-		
+			/*
+			 *  Parameters are kept in insertion order, each name stored once, with an
+			 *  open-addressing (linear probing) index over them. A slot holds the
+			 *  name's hash and index + 1, or 0 if it is empty.
+			 *
+			 *  When read lazily an entry only records where its definition starts in
+			 *  the text, and the values are parsed the first time they are asked for.
+			 *  Entries are shared between copies of a ProcPar, as they never change
+			 *  once parsed.
+			 */
+			struct Entry {
+				std::string name;
+				std::shared_ptr<const char> source; //!< Procpar text or binary cache, until value is parsed
+				size_t size, offset;                //!< Of the source, and of the definition in it
+				bool binary;
+				std::once_flag parsed;
+				Parameter value;
+			};
+			struct Slot {
+				uint32_t hash, index;
+			};
+			std::vector<std::shared_ptr<Entry>> m_parameters;
+			std::vector<Slot> m_slots;
+
+			static uint32_t Hash(const std::string &name);
+			size_t find(const std::string &name) const; //!< Index of name, or m_parameters.size() if it is not there
+			void addSlot(const uint32_t hash, const size_t index);
+			void add(const std::shared_ptr<Entry> &e);
+			const Parameter &value(Entry &e) const; //!< Parses the entry if that has not been done yet
+			void rehash(const size_t nslots);
+			const Parameter &get(const std::string &name) const; //!< Throws if name is not there
+			const Parameter &get(const ParamRef &ref) const;
+
 		public:
 			friend std::ostream& operator<<(std::ostream &os, const ProcPar &p);
 			friend std::istream& operator>>(std::istream &is, ProcPar &p);
 			explicit operator bool() const;
+			/*!
+			 *  Add the parameters from the text of a procpar. If lazy, only the names
+			 *  are read now and each parameter's values are parsed on first access,
+			 *  so errors in them are only thrown then. operator>> reads lazily.
+			 */
+			void read(const std::string &text, const bool lazy = true);
+			void materialise() const; //!< Parse any parameters that were read lazily
+
+			/*!
+			 *  Binary caches. Parsing procpar text is skipped entirely if a cache file
+			 *  is newer than the procpar, judged by its size and mtime, which are
+			 *  stored in it. Caches are mapped and their parameters are decoded lazily
+			 *  too. CachePath() gives path.cache unless the AGILENT_PROCPAR_CACHE
+			 *  environment variable names a directory to keep them all in, or is empty
+			 *  or "off" to disable them, in which case it returns "".
+			 */
+			static ProcPar Load(const std::string &path); //!< Read a procpar, through its cache if that is fresh and intact, and write the cache if not
+			static std::string CachePath(const std::string &path);
+			bool readCache(const std::string &cachePath, const std::string &sourcePath); //!< False if the cache is missing or stale, throws if damaged. May add parameters either way
+			void writeCache(const std::string &cachePath, const std::string &sourcePath) const;
 
 			const bool contains(const std::string &name) const;
-			void insert(const Parameter &p);
+			void insert(const Parameter &p); //!< Does nothing if there is already a parameter with this name
+			void insert(Parameter &&p);
 			void remove(const std::string &name);
 			size_t count() const;
 			
+			ParamRef ref(const std::string &name) const; //!< Resolve a name once, the ref is false if it is not there
 			const Parameter &parameter(const std::string &name) const;
-			const std::vector<std::string> names() const;
+			const Parameter &parameter(const ParamRef &ref) const;
+			const std::vector<std::string> names() const; //!< Sorted
+			const std::string &name(const size_t i) const; //!< In the order read, for i < count(), without copying like names()
 			const double realValue(const std::string &name, const size_t index = 0) const;
+			const double realValue(const ParamRef &ref, const size_t index = 0) const;
 			const Eigen::ArrayXd &realValues(const std::string &name) const;
+			const Eigen::ArrayXd &realValues(const ParamRef &ref) const;
 			const std::string &stringValue(const std::string &name, const size_t index = 0) const;
+			const std::string &stringValue(const ParamRef &ref, const size_t index = 0) const;
 			const std::vector<std::string> &stringValues(const std::string &name) const;
-            Eigen::Affine3f calcTransform() const;
+			const std::vector<std::string> &stringValues(const ParamRef &ref) const;
+            Eigen::Affine3f calcTransform() const; //!< ScanGeometry(*this).transform, for callers that only need that
 	};
+
+	/*
+	 *  A procpar can be embedded in a NIfTI header extension, either as plain text
+	 *  with NIFTI_ECODE_COMMENT or deflated with ProcParZipECode. Procpars are
+	 *  often over 100 KB and compress several fold. The code is not registered,
+	 *  so it is chosen well clear of the codes that are.
+	 */
+	const int ProcParZipECode = 1002;
+	std::vector<char> ProcParExtension(const std::string &path, const bool deflate); //!< Extension data for the procpar at path
+	ProcPar ReadProcParExtension(const std::vector<char> &data, const bool deflated);
 } // End namespace Agilent
 
 #endif
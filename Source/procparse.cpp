@@ -8,55 +8,297 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <list>
 #include <vector>
+#include <algorithm>
+#include <mutex>
+#include <limits>
+#include <cmath>
+#include <cstring>
 #include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "niiNifti.h"
 #include "niiExtensionCodes.h"
 #include "procpar.h"
+#include "util.h"
 
 using namespace std;
 using namespace Agilent;
 using namespace Nifti;
 
 static int partial = false, verbose = false, verbatim = false;
+static int threads = 0;
+static string format = "tsv";
 static struct option long_options[] =
 {
 	{"partial", no_argument, &partial, true},
 	{"verbose", no_argument, &verbose, true},
 	{"verbatim", no_argument, &verbatim, true},
 	{"in", required_argument, 0, 'i'},
+	{"tree", required_argument, 0, 't'},
+	{"list", required_argument, 0, 'l'},
+	{"format", required_argument, 0, 'f'},
+	{"threads", required_argument, 0, 'j'},
 	{0, 0, 0, 0}
 };
 const string usage {
 "procparse - A utility to find interesting information in Agilent procpar files.\n\
 \n\
 Usage: procparse [opts] file1 par1 par2 ... parN\n\
+       procparse [opts] --tree dir --list file ... par1 par2 ... parN\n\
 par1 to parN are parameter names to search for in procpar. If none are specified \
 then the whole file will be listed.\n\
 Options:\n\
  --verbose, -v  : Print filenames, parameter names, and other information.\n\
  --verbatim, -b : Print the full parameter definition\n\
  --partial, -p  : Allow partial matches for parameter names\n\
- --in file, -i  : Read additional procpar files (can specify more than once).\n"
+ --in file, -i  : Read additional procpar files (can specify more than once).\n\
+\n\
+Batch mode, for searching many files. All the arguments are parameter names, and\n\
+one row is printed per file and matching parameter, as each file is finished:\n\
+ --tree dir, -t dir   : Search every file called procpar under dir.\n\
+ --list file, -l file : Search the files listed one per line in file, - for stdin.\n\
+ --format F, -f F     : Print rows as tsv (file, parameter, one value per column)\n\
+                        or json (one object per line). Default tsv.\n\
+ --threads N, -j N    : Read files with N threads (default 0 for all cores).\n\
+Procpar caches are written next to each file unless AGILENT_PROCPAR_CACHE is set.\n"
 };
 
+/*
+ *  The search terms, prepared once and then run against every file. Exact
+ *  terms are looked up through the ProcPar index, partial terms are checked
+ *  against each name in turn without copying the names out. With no terms
+ *  every parameter matches.
+ */
+class Matcher {
+	private:
+		vector<string> m_terms;
+		bool m_partial;
+
+	public:
+		Matcher(vector<string> terms, const bool partial) : m_terms(move(terms)), m_partial(partial) {
+			if (m_partial) {
+				// A term that contains another is redundant
+				sort(m_terms.begin(), m_terms.end(), [](const string &a, const string &b) { return a.size() < b.size(); });
+				vector<string> kept;
+				for (auto &t : m_terms) {
+					if (none_of(kept.begin(), kept.end(), [&t](const string &k) { return t.find(k) != string::npos; }))
+						kept.push_back(t);
+				}
+				m_terms = move(kept);
+			}
+		}
+
+		//! Call f(name) for each parameter in pp that matches, once each
+		template<typename F> void match(const ProcPar &pp, F f) const {
+			if (m_terms.empty() || m_partial) {
+				for (size_t i = 0; i < pp.count(); i++) {
+					const string &n = pp.name(i);
+					if (m_terms.empty() ||
+					    any_of(m_terms.begin(), m_terms.end(), [&n](const string &t) { return n.find(t) != string::npos; }))
+						f(n);
+				}
+			} else {
+				for (size_t i = 0; i < m_terms.size(); i++) {
+					if (pp.contains(m_terms[i]) &&
+					    (find(m_terms.begin(), m_terms.begin() + i, m_terms[i]) == m_terms.begin() + i))
+						f(m_terms[i]);
+				}
+			}
+		}
+};
+
+ProcPar ReadFile(const string &p) {
+	if ((p.find(".nii") != string::npos) || (p.find(".hdr") != string::npos)) {
+		File nii(p);
+		for (auto &e : nii.extensions()) {
+			if ((e.code() == NIFTI_ECODE_COMMENT) || (e.code() == ProcParZipECode))
+				return ReadProcParExtension(e.data(), e.code() == ProcParZipECode);
+		}
+		throw(runtime_error("Could not find procpar in header of file: " + p));
+	}
+	return ProcPar::Load(p);
+}
+
+void FindProcpars(const string &dir, vector<string> &paths) {
+	DIR *dfd = opendir(dir.c_str());
+	if (!dfd)
+		throw(runtime_error("Could not open directory: " + dir));
+	vector<string> subdirs;
+	struct dirent *dp;
+	while ((dp = readdir(dfd))) {
+		if ((strcmp(dp->d_name, ".") == 0) || (strcmp(dp->d_name, "..") == 0))
+			continue;
+		const string path = dir + "/" + dp->d_name;
+		struct stat info;
+		if (lstat(path.c_str(), &info) != 0) // Do not follow links, they could loop
+			continue;
+		if (S_ISDIR(info.st_mode))
+			subdirs.push_back(path);
+		else if (S_ISREG(info.st_mode) && (strcmp(dp->d_name, "procpar") == 0))
+			paths.push_back(path);
+	}
+	closedir(dfd);
+	sort(subdirs.begin(), subdirs.end());
+	for (auto &d : subdirs)
+		FindProcpars(d, paths);
+}
+
+void ReadList(const string &list, vector<string> &paths) {
+	ifstream file;
+	if (list != "-") {
+		file.open(list);
+		if (!file)
+			throw(runtime_error("Could not open file list: " + list));
+	}
+	istream &in = (list == "-") ? cin : file;
+	string line;
+	while (getline(in, line)) {
+		if (!line.empty() && (line.back() == '\r'))
+			line.pop_back();
+		if (!line.empty())
+			paths.push_back(line);
+	}
+}
+
+void Escape(ostream &os, const string &s, const bool json) {
+	for (const char c : s) {
+		switch (c) {
+			case '\\': os << "\\\\"; break;
+			case '\t': os << "\\t"; break;
+			case '\n': os << "\\n"; break;
+			case '\r': os << "\\r"; break;
+			case '"': os << (json ? "\\\"" : "\""); break;
+			default:
+				if (json && (static_cast<unsigned char>(c) < 0x20)) {
+					const char *hex = "0123456789abcdef";
+					os << "\\u00" << hex[c >> 4] << hex[c & 15];
+				} else {
+					os << c;
+				}
+		}
+	}
+}
+
+void WriteRow(ostream &os, const string &file, const Parameter &p) {
+	if (format == "json") {
+		os << "{\"file\":\"";
+		Escape(os, file, true);
+		os << "\",\"parameter\":\"";
+		Escape(os, p.name(), true);
+		os << "\",\"values\":[";
+		if (p.type() == Parameter::Type::Real) {
+			for (Eigen::Index i = 0; i < p.realValues().size(); i++) {
+				const double v = p.realValues()[i];
+				os << (i ? "," : "");
+				if (isfinite(v))
+					os << v;
+				else
+					os << "null"; // JSON has no nan or inf
+			}
+		} else {
+			for (size_t i = 0; i < p.stringValues().size(); i++) {
+				os << (i ? ",\"" : "\"");
+				Escape(os, p.stringValues()[i], true);
+				os << "\"";
+			}
+		}
+		os << "]}\n";
+	} else {
+		Escape(os, file, false);
+		os << "\t";
+		Escape(os, p.name(), false);
+		if (p.type() == Parameter::Type::Real) {
+			for (Eigen::Index i = 0; i < p.realValues().size(); i++)
+				os << "\t" << p.realValues()[i];
+		} else {
+			for (auto &v : p.stringValues()) {
+				os << "\t";
+				Escape(os, v, false);
+			}
+		}
+		os << "\n";
+	}
+}
+
+/*
+ *  Each file is read and matched on its own thread, and its rows are written
+ *  in one go as soon as it is done, so the output is in order of completion.
+ *  A file that cannot be read is reported and skipped.
+ */
+int RunBatch(const vector<string> &paths, const Matcher &matcher) {
+	if ((format != "tsv") && (format != "json")) {
+		cerr << "Unknown output format: " << format << endl;
+		return EXIT_FAILURE;
+	}
+	mutex outMutex;
+	size_t failures = 0, done = 0;
+	ParallelFor(static_cast<int>(paths.size()), threads, [&](const int i, const int) {
+		stringstream rows;
+		rows.precision(numeric_limits<double>::max_digits10);
+		string error;
+		try {
+			const ProcPar pp = ReadFile(paths[i]);
+			matcher.match(pp, [&](const string &n) { WriteRow(rows, paths[i], pp.parameter(n)); });
+		} catch (exception &e) {
+			error = e.what();
+		}
+		lock_guard<mutex> lock(outMutex);
+		done++;
+		if (error.empty()) {
+			cout << rows.str();
+		} else {
+			failures++;
+			cerr << paths[i] << ": " << error << endl;
+		}
+		if (verbose)
+			cerr << "Read " << done << " of " << paths.size() << " files" << endl;
+	});
+	cout.flush();
+	if (verbose || failures)
+		cerr << failures << " of " << paths.size() << " files could not be read" << endl;
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
 	int indexptr = 0, c;
 	list<string> paths;
-	while ((c = getopt_long(argc, argv, "phvbi:", long_options, &indexptr)) != -1) {
+	vector<string> trees, lists;
+	while ((c = getopt_long(argc, argv, "phvbi:t:l:f:j:", long_options, &indexptr)) != -1) {
 		switch (c) {
 			case 0: break; // It was an option that just sets a flag.
 			case 'v': verbose = true; break;
 			case 'b': verbatim = true; break;
 			case 'p': partial = true; break;
 			case 'i': paths.emplace_back(optarg); break;
+			case 't': trees.emplace_back(optarg); break;
+			case 'l': lists.emplace_back(optarg); break;
+			case 'f': format = optarg; break;
+			case 'j': threads = atoi(optarg); break;
 			case 'h': cout << usage << endl; break;
 			default: cout << "Unknown option " << optarg << endl;
 		}
 	}
 	
+	if (!trees.empty() || !lists.empty()) {
+		vector<string> files(paths.begin(), paths.end());
+		try {
+			for (auto &t : trees)
+				FindProcpars(t, files);
+			for (auto &l : lists)
+				ReadList(l, files);
+		} catch (exception &e) {
+			cerr << e.what() << endl;
+			return EXIT_FAILURE;
+		}
+		if (verbose)
+			cerr << "Found " << files.size() << " files" << endl;
+		return RunBatch(files, Matcher(vector<string>(argv + optind, argv + argc), partial));
+	}
+
 	if ((argc - optind) <= 0) {
 		cout << "No procpar file specified." << endl << usage << endl;
 		return EXIT_FAILURE;
@@ -65,53 +307,31 @@ int main(int argc, char **argv) {
 		
 	vector<ProcPar> pps;
 	for (auto &p : paths) {
-		ProcPar pp;
 		try {
-			if ((p.find(".nii") != string::npos) || (p.find(".hdr") != string::npos)) {
-				File nii(p);
-				const list<Extension> &exts = nii.extensions();
-				bool found = false;
-				for (auto &e : exts) {
-					if (e.code() == NIFTI_ECODE_COMMENT) {
-						string s(e.data().begin(), e.data().end());
-						stringstream ss(s);
-						ss >> pp;
-						pps.push_back(pp);
-						found = true;
-					}
-				}
-				if (!found) {
-					throw(runtime_error("Could not find procpar in header of file: " + p));
-				}
-			} else {
-				ifstream pp_file(p);
-				pp_file >> pp;
-				if (!pp_file.eof()) {
-					throw(runtime_error("Failed to read contents of file: " + p));
-				}
-				pps.push_back(pp);
-			}
+			pps.push_back(ReadFile(p));
 		} catch (exception &e) {
 			cerr << e.what() << endl;
 			return EXIT_FAILURE;
 		}
 	}
 	
-	while (optind < argc) {
-		string searchName(argv[optind]);
-		auto pp_it = pps.begin();
-		auto path_it = paths.begin();
-		for (; pp_it != pps.end() && path_it != paths.end(); pp_it++, path_it++) {
-			if (verbose) {
-				cout << *path_it << " ";
-			}
-			if (partial) {
-				size_t matches(0);
-				vector<string> names = pp_it->names();
-				if (verbose)
-					cout << "Partial matches for: " << searchName << endl;
-				for (auto &n : names) {
-					if (n.find(searchName) != string::npos) {
+	// Parameters are parsed as they are asked for, so errors can turn up here too
+	try {
+		while (optind < argc) {
+			string searchName(argv[optind]);
+			auto pp_it = pps.begin();
+			auto path_it = paths.begin();
+			for (; pp_it != pps.end() && path_it != paths.end(); pp_it++, path_it++) {
+				if (verbose) {
+					cout << *path_it << " ";
+				}
+				if (partial) {
+					vector<string> names;
+					Matcher({searchName}, true).match(*pp_it, [&names](const string &n) { names.push_back(n); });
+					sort(names.begin(), names.end());
+					if (verbose)
+						cout << "Partial matches for: " << searchName << endl;
+					for (auto &n : names) {
 						if (verbatim) {
 							cout << pp_it->parameter(n) << endl;
 						} else {
@@ -120,26 +340,28 @@ int main(int argc, char **argv) {
 							}
 							cout << pp_it->parameter(n).print_values() << endl;
 						}
-						matches++;
 					}
-				}
-				if (verbose)
-					cout << matches << " matches." << endl << endl;
-			} else if (pp_it->contains(searchName)) {
-				if (verbatim) {
-					cout << pp_it->parameter(searchName) << endl;
-				} else {
-					if (verbose) {
-						cout << searchName << ": ";
+					if (verbose)
+						cout << names.size() << " matches." << endl << endl;
+				} else if (pp_it->contains(searchName)) {
+					if (verbatim) {
+						cout << pp_it->parameter(searchName) << endl;
+					} else {
+						if (verbose) {
+							cout << searchName << ": ";
+						}
+						cout << pp_it->parameter(searchName).print_values() << endl;
 					}
-					cout << pp_it->parameter(searchName).print_values() << endl;
+				} else {
+					if (verbose)
+						cout << "Parameter not found: " << searchName << endl;
 				}
-			} else {
-				if (verbose)
-					cout << "Parameter not found: " << searchName << endl;
 			}
+			optind++;
 		}
-		optind++;
+	} catch (exception &e) {
+		cerr << e.what() << endl;
+		return EXIT_FAILURE;
 	}
     return EXIT_SUCCESS;
 }
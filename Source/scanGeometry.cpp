@@ -0,0 +1,98 @@
+/*
+ *  scanGeometry.cpp
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#include "scanGeometry.h"
+
+#include <cmath>
+
+using namespace std;
+using namespace Eigen;
+
+namespace Agilent {
+
+namespace {
+
+double Optional(const ProcPar &pp, const string &name, const double fallback) {
+	return pp.contains(name) ? pp.realValue(name) : fallback;
+}
+
+} // End anonymous namespace
+
+ScanGeometry::ScanGeometry() :
+	multislice(false), dims(Array3i::Zero()), voxdims(Array3d::Ones()), offset(Array3d::Zero()),
+	rotation(Matrix3d::Identity()), transform(Affine3d::Identity()), phaseRamp(Array3d::Zero()),
+	np(0), echoes(1), slabs(1), segments(1), arrayDim(1), echoFraction(1)
+{}
+
+ScanGeometry::ScanGeometry(const ProcPar &pp) : ScanGeometry() {
+	readCounts(pp);
+	multislice = (pp.stringValue("apptype") == "im2D");
+	dims[0] = lround(np / echoFraction);
+	dims[1] = pp.realValue("nv");
+	dims[2] = multislice ? pp.realValue("ns") : pp.realValue("nv2");
+	calculate(pp);
+}
+
+ScanGeometry::ScanGeometry(const ProcPar &pp, const Array3i &d, const bool ms) : ScanGeometry() {
+	readCounts(pp);
+	multislice = ms;
+	dims = d;
+	calculate(pp);
+}
+
+void ScanGeometry::readCounts(const ProcPar &pp) {
+	np = pp.realValue("np") / 2;
+	echoes = Optional(pp, "ne", 1);
+	slabs = pp.contains("pss") ? pp.parameter("pss").nvals() : 1; // ns will be 1 for standard looping
+	segments = Optional(pp, "nseg", 1);
+	arrayDim = Optional(pp, "arraydim", 1);
+	echoFraction = Optional(pp, "echo_fraction", 1);
+	if (pp.contains("pelist"))
+		pelist = pp.realValues("pelist").cast<int>();
+}
+
+void ScanGeometry::calculate(const ProcPar &pp) {
+	// Now we have the joy of calculating a correct orientation field
+	// Get "Euler" angles. These describe how to get to the user frame
+	// from the magnet frame.
+	const double psi = pp.realValue("psi"), phi = pp.realValue("phi"),
+	             tht = pp.realValue("theta");
+
+	const double sinphi = sin(phi*M_PI/180.), cosphi = cos(phi*M_PI/180.);
+	const double sintht = sin(tht*M_PI/180.), costht = cos(tht*M_PI/180.);
+	const double sinpsi = sin(psi*M_PI/180.), cospsi = cos(psi*M_PI/180.);
+
+	// Now for the vox dimensions and offsets in the user frame
+	// The offset for the RO axis appears to be negative versus the PE/PE2 axis
+	// Verified in a mouse dataset 13/11/21
+	const double lro = pp.realValue("lro"), lpe = pp.realValue("lpe"), ppe = pp.realValue("ppe");
+	voxdims[0] = lro/dims[0];
+	offset[0]  = -pp.realValue("pro") - (lro - voxdims[0])/2.;
+	voxdims[1] = lpe/dims[1];
+	offset[1]  = ppe - (lpe - voxdims[1])/2.;
+	phaseRamp[1] = -2*M_PI*ppe/lpe;
+	if (multislice) {
+		voxdims[2] = pp.realValue("thk")/10. + pp.realValue("gap"); // thk seems to be in mm already
+		const ArrayXd &pss = pp.realValues("pss");
+		offset[2] = pss.minCoeff(); // The most negative slice center
+	} else {
+		const double lpe2 = pp.realValue("lpe2"), ppe2 = pp.realValue("ppe2");
+		voxdims[2] = lpe2/dims[2];
+		offset[2]  = ppe2 - (lpe2 - voxdims[2])/2.;
+		phaseRamp[2] = -2*M_PI*ppe2/lpe2;
+	}
+	// Now build the transform matrix - the 10 is to convert from cm to mm
+	voxdims *= 10.;
+	offset *= 10.;
+	// From Michael Gyngell
+	rotation << -cospsi*sinphi + sinpsi*costht*cosphi, -cospsi*cosphi - sinpsi*costht*sinphi, sinpsi*sintht,
+	             sinpsi*sinphi + cospsi*costht*cosphi,  sinpsi*cosphi - cospsi*costht*sinphi, cospsi*sintht,
+	            -sintht*cosphi, sintht*sinphi, costht;
+	transform = Affine3d(rotation) * Translation3d(offset.matrix()) * Scaling(voxdims.matrix());
+}
+
+} // End namespace Agilent
@@ -0,0 +1,55 @@
+/*
+ *  scanGeometry.h
+ *  Part of Agilent Tools
+ *
+ *  Copyright (c) 2015 Tobias Wood
+ */
+
+#ifndef AGILENT_SCANGEOMETRY
+#define AGILENT_SCANGEOMETRY
+
+#include "Eigen/Core"
+#include "Eigen/Geometry"
+
+#include "procpar.h"
+
+namespace Agilent {
+
+/*
+ *  Everything about where and how a scan was acquired that recon and
+ *  conversion need, read from the procpar once so that per-volume code does
+ *  not keep looking parameters up by name. A plain value, so it can be copied
+ *  around freely.
+ *
+ *  dims is the image matrix. From a procpar alone that is the full-echo
+ *  readout length, nv, and nv2 or the number of slices. fdf images can be
+ *  reconstructed at another size, so their dims can be given instead. Distances
+ *  are in mm. transform maps voxel indices to the magnet frame.
+ */
+class ScanGeometry {
+	public:
+		bool multislice;          //!< apptype im2D, so z is slices instead of a second phase encode
+		Eigen::Array3i dims;      //!< x y z
+		Eigen::Array3d voxdims;
+		Eigen::Array3d offset;    //!< Of the first voxel centre, in the user frame
+		Eigen::Matrix3d rotation; //!< From the user frame to the magnet frame, from psi, phi and theta
+		Eigen::Affine3d transform;
+		Eigen::Array3d phaseRamp; //!< Radians per k-space line that move the image to the centre of the FOV
+
+		int np;                   //!< Complex points acquired per echo
+		int echoes, slabs, segments, arrayDim;
+		double echoFraction;      //!< Fraction of each echo that was acquired, 1 for full echoes
+		Eigen::ArrayXi pelist;    //!< Phase encode order, empty if the sequence did not set one
+
+		ScanGeometry();
+		explicit ScanGeometry(const ProcPar &pp);
+		ScanGeometry(const ProcPar &pp, const Eigen::Array3i &dims, const bool multislice);
+
+	protected:
+		void calculate(const ProcPar &pp);
+		void readCounts(const ProcPar &pp);
+};
+
+} // End namespace Agilent
+
+#endif // AGILENT_SCANGEOMETRY
@@ -9,6 +9,13 @@
 #ifndef AGILENT_AGILENT
 #define AGILENT_AGILENT
 
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+
 namespace Agilent {
 
 enum Endianness {
@@ -32,5 +39,52 @@ void SwapEndianness(T *ptr, int n = 1) {
 	}
 }
 
+//! Resolve a requested thread count, where < 1 means all hardware threads
+inline int ThreadCount(const int requested) {
+	if (requested < 1)
+		return std::max(1u, std::thread::hardware_concurrency());
+	return requested;
+}
+
+/*
+ *  Call f(i, thread) for i in [0, n) using up to nthreads threads, which take
+ *  the next index as they finish the last. thread is in [0, nthreads) so callers
+ *  can keep per-thread buffers. nthreads < 1 means use all hardware threads.
+ *  The first exception thrown by f stops the remaining work and is rethrown.
+ */
+template <typename F>
+void ParallelFor(const int n, const int requested, F f) {
+	const int nthreads = std::min(ThreadCount(requested), n);
+	if (nthreads <= 1) {
+		for (int i = 0; i < n; i++)
+			f(i, 0);
+		return;
+	}
+	std::atomic<int> next(0);
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	auto worker = [&](const int thread) {
+		int i;
+		while ((i = next++) < n) {
+			try {
+				f(i, thread);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!error)
+					error = std::current_exception();
+				next = n;
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int t = 1; t < nthreads; t++)
+		threads.emplace_back(worker, t);
+	worker(0);
+	for (auto &t : threads)
+		t.join();
+	if (error)
+		std::rethrow_exception(error);
+}
+
 } // End namespace Agilent
 #endif